@@ -0,0 +1,160 @@
+/*
+ * abr_controller.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#include "abr_controller.h"
+
+/* weight of a new bandwidth sample in the moving average */
+#define ABR_BANDWIDTH_WEIGHT 0.3
+/* share of the bandwidth the stream may use, less when the buffer runs low */
+#define ABR_SAFETY 0.8
+#define ABR_LOW_BUFFER_PERCENT 30
+#define ABR_LOW_BUFFER_SAFETY 0.5
+/* more than this share of late frames means the board cannot keep up with
+ * the resolution: it is lowered one step, and raised back one step after
+ * ABR_RELAX_SAMPLES samples without drops */
+#define ABR_DROP_PERCENT 10
+#define ABR_SCALE_STEP 0.75
+#define ABR_SCALE_MIN 0.25
+#define ABR_RELAX_SAMPLES 10
+/* switching down is immediate, switching up waits for the estimate to stay
+ * ABR_HYSTERESIS_PERCENT above the cap for ABR_UP_SAMPLES samples */
+#define ABR_HYSTERESIS_PERCENT 15
+#define ABR_UP_SAMPLES 3
+
+typedef struct _AbrController {
+  GMutex lock;
+  int ceiling_width;
+  int ceiling_height;
+  uint64_t ceiling_bitrate;
+  bool ceiling_changed;
+
+  double bandwidth;
+  double scale;             /* of the ceiling resolution */
+  int clean_samples;
+  int up_samples;
+  bool decided;
+  AbrDecision current;
+} AbrController;
+
+static int scale_size (int size, double scale)
+{
+    /* even sizes, as the decoders want them */
+    return size ? MAX (2, (int) (size * scale) & ~1) : 0;
+}
+
+void *AbrController_create(void)
+{
+    AbrController *abr = g_new0 (AbrController, 1);
+
+    g_mutex_init (&abr->lock);
+    abr->scale = 1.0;
+    return abr;
+}
+
+void AbrController_destroy(void *handle)
+{
+    AbrController *abr = (AbrController *) handle;
+
+    g_mutex_clear (&abr->lock);
+    g_free (abr);
+}
+
+void AbrController_setCeiling(void *handle, int width, int height,
+        uint64_t max_bitrate)
+{
+    AbrController *abr = (AbrController *) handle;
+
+    g_mutex_lock (&abr->lock);
+    if (abr->ceiling_width != width || abr->ceiling_height != height ||
+        abr->ceiling_bitrate != max_bitrate) {
+        abr->ceiling_width = width;
+        abr->ceiling_height = height;
+        abr->ceiling_bitrate = max_bitrate;
+        abr->ceiling_changed = true;
+    }
+    g_mutex_unlock (&abr->lock);
+}
+
+bool AbrController_update(void *handle, const AbrSample *sample,
+        AbrDecision *decision)
+{
+    AbrController *abr = (AbrController *) handle;
+    const char *reason = "bandwidth";
+    uint64_t total = sample->processed + sample->dropped;
+    uint64_t current, target;
+    double safety = ABR_SAFETY;
+    int width, height;
+    bool apply = false;
+
+    g_mutex_lock (&abr->lock);
+    if (sample->bandwidth)
+        abr->bandwidth = abr->bandwidth ?
+                (1 - ABR_BANDWIDTH_WEIGHT) * abr->bandwidth +
+                ABR_BANDWIDTH_WEIGHT * sample->bandwidth :
+                sample->bandwidth;
+
+    if (total && sample->dropped * 100 > total * ABR_DROP_PERCENT) {
+        abr->clean_samples = 0;
+        if (abr->scale > ABR_SCALE_MIN) {
+            abr->scale = MAX (ABR_SCALE_MIN, abr->scale * ABR_SCALE_STEP);
+            reason = "drops";
+        }
+    } else if (++abr->clean_samples >= ABR_RELAX_SAMPLES && abr->scale < 1.0) {
+        abr->clean_samples = 0;
+        abr->scale = MIN (1.0, abr->scale / ABR_SCALE_STEP);
+        reason = "recovered";
+    }
+
+    if (sample->buffer_percent >= 0 &&
+        sample->buffer_percent < ABR_LOW_BUFFER_PERCENT) {
+        safety = ABR_LOW_BUFFER_SAFETY;
+        if (strcmp (reason, "bandwidth") == 0)
+            reason = "buffer";
+    }
+
+    /* bitrate follows the number of pixels */
+    target = (uint64_t) (abr->bandwidth * safety * abr->scale * abr->scale);
+    if (abr->ceiling_bitrate && (!target || target > abr->ceiling_bitrate)) {
+        target = abr->ceiling_bitrate;
+        if (strcmp (reason, "drops") != 0 && strcmp (reason, "recovered") != 0)
+            reason = "ceiling";
+    }
+    width = scale_size (abr->ceiling_width, abr->scale);
+    height = scale_size (abr->ceiling_height, abr->scale);
+
+    current = abr->current.max_bitrate;
+    if (!abr->decided || abr->ceiling_changed ||
+        width != abr->current.max_width || height != abr->current.max_height) {
+        apply = true;
+    } else if (target && (!current ||
+               target * 100 < current * (100 - ABR_HYSTERESIS_PERCENT))) {
+        apply = true;
+    } else if ((!target && current) ||
+               target * 100 > current * (100 + ABR_HYSTERESIS_PERCENT)) {
+        apply = ++abr->up_samples >= ABR_UP_SAMPLES;
+    } else {
+        abr->up_samples = 0;
+    }
+
+    if (apply) {
+        abr->current.max_bitrate = target;
+        abr->current.max_width = width;
+        abr->current.max_height = height;
+        abr->current.bandwidth = (uint64_t) abr->bandwidth;
+        abr->current.reason = reason;
+        abr->decided = true;
+        abr->ceiling_changed = false;
+        abr->up_samples = 0;
+        *decision = abr->current;
+    }
+    g_mutex_unlock (&abr->lock);
+    return apply;
+}
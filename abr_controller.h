@@ -0,0 +1,45 @@
+/*
+ * abr_controller.h
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#ifndef PPAPI_GSTREAMER_ABR_CONTROLLER_H_
+#define PPAPI_GSTREAMER_ABR_CONTROLLER_H_
+
+#include <stdint.h>
+
+/* Adaptive bitrate decisions for HLS/DASH playback. The controller does
+ * not know the variants, it caps the bitrate and the resolution the
+ * demuxer may pick from, out of the measured bandwidth, the buffer level
+ * and the frames the sink dropped, within a ceiling given by the embed. */
+
+/* What happened since the previous sample, one sample per second */
+typedef struct _AbrSample {
+  uint64_t bandwidth;       /* bits/s, 0 when not measured */
+  int buffer_percent;       /* -1 when unknown */
+  uint64_t processed;       /* frames the video sink rendered */
+  uint64_t dropped;         /* frames it dropped as late */
+} AbrSample;
+
+/* 0 means unlimited */
+typedef struct _AbrDecision {
+  uint64_t max_bitrate;     /* bits/s */
+  int max_width;
+  int max_height;
+  uint64_t bandwidth;       /* smoothed estimate the decision is based on */
+  const char *reason;       /* "bandwidth", "buffer", "drops", "recovered" or "ceiling" */
+} AbrDecision;
+
+void *AbrController_create(void);
+void AbrController_destroy(void *abr);
+
+/* Thread safe, usually the displayed size of the video */
+void AbrController_setCeiling(void *abr, int width, int height,
+        uint64_t max_bitrate);
+
+/* Returns true and fills decision when the caps changed */
+bool AbrController_update(void *abr, const AbrSample *sample,
+        AbrDecision *decision);
+
+#endif /*  PPAPI_GSTREAMER_ABR_CONTROLLER_H_ */
@@ -0,0 +1,115 @@
+/*
+ * audio_ring.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <string.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#include "audio_ring.h"
+
+/* read and write are free-running byte counts, each advanced by its own
+ * side only; the g_atomic accesses order the copies of the data before
+ * the position that publishes them. The size is a power of two so that
+ * the counts stay valid offsets when they wrap. */
+typedef struct _AudioRing {
+  uint8_t *data;
+  uint32_t size;
+  volatile guint read;
+  volatile guint write;
+} AudioRing;
+
+void *AudioRing_create(uint32_t size)
+{
+    AudioRing *ring;
+
+    if (!size || size > (1u << 31))
+        return NULL;
+    ring = g_new0 (AudioRing, 1);
+    ring->size = 1;
+    while (ring->size < size)
+        ring->size <<= 1;
+    ring->data = (uint8_t *) g_malloc (ring->size);
+    return ring;
+}
+
+void AudioRing_destroy(void *ring_)
+{
+    AudioRing *ring = (AudioRing *) ring_;
+
+    if (!ring)
+        return;
+    g_free (ring->data);
+    g_free (ring);
+}
+
+uint32_t AudioRing_write(void *ring_, const uint8_t *data, uint32_t size)
+{
+    AudioRing *ring = (AudioRing *) ring_;
+    guint write = ring->write;
+    guint free_bytes = ring->size - (write - g_atomic_int_get (&ring->read));
+    guint offset = write % ring->size;
+    guint first;
+
+    if (size > free_bytes)
+        size = free_bytes;
+    first = MIN (size, ring->size - offset);
+    memcpy (ring->data + offset, data, first);
+    memcpy (ring->data, data + first, size - first);
+    g_atomic_int_set (&ring->write, write + size);
+    return size;
+}
+
+uint32_t AudioRing_read(void *ring_, uint8_t *data, uint32_t size)
+{
+    AudioRing *ring = (AudioRing *) ring_;
+    guint read = ring->read;
+    guint fill = g_atomic_int_get (&ring->write) - read;
+    guint offset = read % ring->size;
+    guint first;
+
+    if (size > fill)
+        size = fill;
+    if (data) {
+        first = MIN (size, ring->size - offset);
+        memcpy (data, ring->data + offset, first);
+        memcpy (data + first, ring->data, size - first);
+    }
+    g_atomic_int_set (&ring->read, read + size);
+    return size;
+}
+
+void AudioRing_discard(void *ring_)
+{
+    AudioRing *ring = (AudioRing *) ring_;
+
+    g_atomic_int_set (&ring->read, g_atomic_int_get (&ring->write));
+}
+
+uint32_t AudioRing_fill(void *ring_)
+{
+    AudioRing *ring = (AudioRing *) ring_;
+    guint read = g_atomic_int_get (&ring->read);
+    guint fill = g_atomic_int_get (&ring->write) - read;
+
+    /* both may have moved in between */
+    return MIN (fill, ring->size);
+}
+
+uint32_t AudioRing_size(void *ring_)
+{
+    return ((AudioRing *) ring_)->size;
+}
+
+uint32_t AudioRing_readPosition(void *ring_)
+{
+    return g_atomic_int_get (&((AudioRing *) ring_)->read);
+}
+
+uint32_t AudioRing_writePosition(void *ring_)
+{
+    return g_atomic_int_get (&((AudioRing *) ring_)->write);
+}
@@ -0,0 +1,35 @@
+/*
+ * audio_ring.h
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#ifndef PPAPI_GSTREAMER_AUDIO_RING_H_
+#define PPAPI_GSTREAMER_AUDIO_RING_H_
+
+#include <stdint.h>
+
+/* Lock-free single-producer/single-consumer byte ring carrying PCM from
+ * the streaming thread of the audio sink to the audio device callback,
+ * which must never wait for a lock. write is only called by the producer,
+ * read and discard only by the consumer; fill may be called by anyone. */
+
+/* size is rounded up to a power of two */
+void *AudioRing_create(uint32_t size);
+void AudioRing_destroy(void *ring);
+
+/* Copies as much of data as fits, returns the bytes written */
+uint32_t AudioRing_write(void *ring, const uint8_t *data, uint32_t size);
+/* Copies up to size bytes out, or drops them when data is NULL, returns
+ * the bytes read */
+uint32_t AudioRing_read(void *ring, uint8_t *data, uint32_t size);
+/* Drops everything written so far */
+void AudioRing_discard(void *ring);
+
+uint32_t AudioRing_fill(void *ring);
+uint32_t AudioRing_size(void *ring);
+/* Bytes read and written since the ring was created, wrapping at 2^32 */
+uint32_t AudioRing_readPosition(void *ring);
+uint32_t AudioRing_writePosition(void *ring);
+
+#endif /*  PPAPI_GSTREAMER_AUDIO_RING_H_ */
@@ -0,0 +1,194 @@
+/*
+ * frame_capture.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#include "frame_capture.h"
+
+#define FRAME_CAPTURE_MAGIC "PPGSTFC1"
+#define FRAME_CAPTURE_MAGIC_SIZE 8
+/* a record header: type, flags, 2 reserved bytes, frame size, payload
+ * size, 4 reserved bytes, pts, duration and arrival time */
+#define FRAME_CAPTURE_HEADER_SIZE 40
+#define FRAME_CAPTURE_FLAG_PAYLOAD 0x1
+/* stdio buffer, frames are written with few large sequential writes */
+#define FRAME_CAPTURE_IO_BUFFER (1024 * 1024)
+
+typedef struct _FrameCapture {
+  FILE *file;
+  bool payload;
+  bool failed;
+  gint64 start_us;
+  /* reader: payload of the last record */
+  uint8_t *data;
+  uint32_t data_size;
+} FrameCapture;
+
+static void put_u32 (uint8_t *p, uint32_t value)
+{
+    value = GUINT32_TO_LE (value);
+    memcpy (p, &value, sizeof (value));
+}
+
+static void put_i64 (uint8_t *p, int64_t value)
+{
+    guint64 le = GUINT64_TO_LE ((guint64) value);
+    memcpy (p, &le, sizeof (le));
+}
+
+static uint32_t get_u32 (const uint8_t *p)
+{
+    uint32_t value;
+    memcpy (&value, p, sizeof (value));
+    return GUINT32_FROM_LE (value);
+}
+
+static int64_t get_i64 (const uint8_t *p)
+{
+    guint64 value;
+    memcpy (&value, p, sizeof (value));
+    return (int64_t) GUINT64_FROM_LE (value);
+}
+
+static FrameCapture *capture_open (const char *path, const char *mode)
+{
+    FrameCapture *capture;
+    FILE *file = fopen (path, mode);
+
+    if (!file)
+        return NULL;
+    capture = g_new0 (FrameCapture, 1);
+    capture->file = file;
+    setvbuf (file, NULL, _IOFBF, FRAME_CAPTURE_IO_BUFFER);
+    return capture;
+}
+
+static bool capture_write (FrameCapture *capture, FrameCaptureRecordType type,
+        int64_t pts, int64_t duration, uint32_t frame_size,
+        const uint8_t *data, uint32_t size)
+{
+    uint8_t header[FRAME_CAPTURE_HEADER_SIZE] = { 0, };
+    gint64 now = g_get_monotonic_time ();
+
+    if (capture->failed)
+        return false;
+    if (!capture->start_us)
+        capture->start_us = now;
+
+    header[0] = type;
+    header[1] = data ? FRAME_CAPTURE_FLAG_PAYLOAD : 0;
+    put_u32 (header + 4, frame_size);
+    put_u32 (header + 8, data ? size : 0);
+    put_i64 (header + 16, pts);
+    put_i64 (header + 24, duration);
+    put_i64 (header + 32, now - capture->start_us);
+
+    if (fwrite (header, sizeof (header), 1, capture->file) != 1 ||
+        (data && size && fwrite (data, size, 1, capture->file) != 1)) {
+        g_printerr ("frame capture: write failed, capture stopped.\n");
+        capture->failed = true;
+        return false;
+    }
+    return true;
+}
+
+void *FrameCapture_openWriter(const char *path, bool payload)
+{
+    FrameCapture *capture = capture_open (path, "wb");
+    uint8_t flags[4];
+
+    if (!capture)
+        return NULL;
+    capture->payload = payload;
+    put_u32 (flags, payload ? FRAME_CAPTURE_FLAG_PAYLOAD : 0);
+    if (fwrite (FRAME_CAPTURE_MAGIC, FRAME_CAPTURE_MAGIC_SIZE, 1, capture->file) != 1 ||
+        fwrite (flags, sizeof (flags), 1, capture->file) != 1) {
+        FrameCapture_close (capture);
+        return NULL;
+    }
+    return capture;
+}
+
+bool FrameCapture_writeCaps(void *handle, const char *caps)
+{
+    FrameCapture *capture = (FrameCapture *) handle;
+    uint32_t size = strlen (caps) + 1;
+
+    return capture_write (capture, FRAME_CAPTURE_CAPS, -1, -1, 0,
+            (const uint8_t *) caps, size);
+}
+
+bool FrameCapture_writeFrame(void *handle, int64_t pts, int64_t duration,
+        const uint8_t *data, uint32_t size)
+{
+    FrameCapture *capture = (FrameCapture *) handle;
+
+    return capture_write (capture, FRAME_CAPTURE_FRAME, pts, duration, size,
+            capture->payload ? data : NULL, size);
+}
+
+void *FrameCapture_openReader(const char *path)
+{
+    FrameCapture *capture = capture_open (path, "rb");
+    char magic[FRAME_CAPTURE_MAGIC_SIZE];
+    uint8_t flags[4];
+
+    if (!capture)
+        return NULL;
+    if (fread (magic, sizeof (magic), 1, capture->file) != 1 ||
+        memcmp (magic, FRAME_CAPTURE_MAGIC, sizeof (magic)) != 0 ||
+        fread (flags, sizeof (flags), 1, capture->file) != 1) {
+        g_printerr ("frame capture: %s is not a capture file.\n", path);
+        FrameCapture_close (capture);
+        return NULL;
+    }
+    capture->payload = get_u32 (flags) & FRAME_CAPTURE_FLAG_PAYLOAD;
+    return capture;
+}
+
+bool FrameCapture_read(void *handle, FrameCaptureRecord *record)
+{
+    FrameCapture *capture = (FrameCapture *) handle;
+    uint8_t header[FRAME_CAPTURE_HEADER_SIZE];
+    uint32_t size;
+
+    if (fread (header, sizeof (header), 1, capture->file) != 1)
+        return false;
+    size = get_u32 (header + 8);
+    if (header[0] > FRAME_CAPTURE_FRAME || size > FRAME_CAPTURE_MAX_RECORD)
+        return false;
+    if (size > capture->data_size) {
+        capture->data = (uint8_t *) g_realloc (capture->data, size);
+        capture->data_size = size;
+    }
+    if (size && fread (capture->data, size, 1, capture->file) != 1)
+        return false;
+    /* caps strings are written with their terminator, do not trust it */
+    if (header[0] == FRAME_CAPTURE_CAPS && (!size || capture->data[size - 1]))
+        return false;
+
+    record->type = (FrameCaptureRecordType) header[0];
+    record->frame_size = get_u32 (header + 4);
+    record->pts = get_i64 (header + 16);
+    record->duration = get_i64 (header + 24);
+    record->arrival_us = get_i64 (header + 32);
+    record->data = (header[1] & FRAME_CAPTURE_FLAG_PAYLOAD) ? capture->data : NULL;
+    record->size = size;
+    return true;
+}
+
+void FrameCapture_close(void *handle)
+{
+    FrameCapture *capture = (FrameCapture *) handle;
+
+    fclose (capture->file);
+    g_free (capture->data);
+    g_free (capture);
+}
@@ -0,0 +1,53 @@
+/*
+ * frame_capture.h
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#ifndef PPAPI_GSTREAMER_FRAME_CAPTURE_H_
+#define PPAPI_GSTREAMER_FRAME_CAPTURE_H_
+
+#include <stdint.h>
+
+/* Streaming file of the decoded frames handed to the render side: a header
+ * followed by records, each a fixed-size little-endian header and its
+ * payload. Caps records carry the caps string the next frames are in,
+ * frame records their timestamps and, optionally, their bytes. */
+
+/* Sanity limit for the payloads and frame sizes read back, above any RGB
+ * frame we decode */
+#define FRAME_CAPTURE_MAX_RECORD (64 * 1024 * 1024)
+
+typedef enum {
+  FRAME_CAPTURE_CAPS,
+  FRAME_CAPTURE_FRAME
+} FrameCaptureRecordType;
+
+typedef struct _FrameCaptureRecord {
+  FrameCaptureRecordType type;
+  int64_t pts;              /* ns, -1 when unknown */
+  int64_t duration;         /* ns, -1 when unknown */
+  int64_t arrival_us;       /* since the first record */
+  uint32_t frame_size;      /* bytes of the decoded frame */
+  /* caps string or frame bytes, NULL for frames captured without payload,
+   * owned by the reader and valid until the next FrameCapture_read */
+  const uint8_t *data;
+  uint32_t size;
+} FrameCaptureRecord;
+
+void *FrameCapture_openWriter(const char *path, bool payload);
+/* Both return false once a write failed and write nothing more: the file
+ * ends with what was written until then, possibly a partial record the
+ * reader stops at */
+bool FrameCapture_writeCaps(void *capture, const char *caps);
+bool FrameCapture_writeFrame(void *capture, int64_t pts, int64_t duration,
+        const uint8_t *data, uint32_t size);
+
+void *FrameCapture_openReader(const char *path);
+/* Returns false at the end of the file or on a corrupted record */
+bool FrameCapture_read(void *capture, FrameCaptureRecord *record);
+
+/* Closes a writer or a reader */
+void FrameCapture_close(void *capture);
+
+#endif /*  PPAPI_GSTREAMER_FRAME_CAPTURE_H_ */
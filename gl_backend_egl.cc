@@ -0,0 +1,305 @@
+/*
+ * gl_backend_egl.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+
+#include "gl_backend_egl.h"
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+namespace {
+
+// PPB_OpenGLES2 entry points on the current EGL context.
+void ActiveTexture(PP_Resource, GLenum texture) {
+  glActiveTexture(texture);
+}
+void AttachShader(PP_Resource, GLuint program, GLuint shader) {
+  glAttachShader(program, shader);
+}
+void BindAttribLocation(PP_Resource, GLuint program, GLuint index,
+                        const char* name) {
+  glBindAttribLocation(program, index, name);
+}
+void BindBuffer(PP_Resource, GLenum target, GLuint buffer) {
+  glBindBuffer(target, buffer);
+}
+void BindTexture(PP_Resource, GLenum target, GLuint texture) {
+  glBindTexture(target, texture);
+}
+void BufferData(PP_Resource, GLenum target, GLsizeiptr size,
+                const void* data, GLenum usage) {
+  glBufferData(target, size, data, usage);
+}
+void Clear(PP_Resource, GLbitfield mask) {
+  glClear(mask);
+}
+void ClearColor(PP_Resource, GLclampf red, GLclampf green, GLclampf blue,
+                GLclampf alpha) {
+  glClearColor(red, green, blue, alpha);
+}
+void CompileShader(PP_Resource, GLuint shader) {
+  glCompileShader(shader);
+}
+GLuint CreateProgram(PP_Resource) {
+  return glCreateProgram();
+}
+GLuint CreateShader(PP_Resource, GLenum type) {
+  return glCreateShader(type);
+}
+void DeleteBuffers(PP_Resource, GLsizei n, const GLuint* buffers) {
+  glDeleteBuffers(n, buffers);
+}
+void DeleteProgram(PP_Resource, GLuint program) {
+  glDeleteProgram(program);
+}
+void DeleteShader(PP_Resource, GLuint shader) {
+  glDeleteShader(shader);
+}
+void DeleteTextures(PP_Resource, GLsizei n, const GLuint* textures) {
+  glDeleteTextures(n, textures);
+}
+void DrawArrays(PP_Resource, GLenum mode, GLint first, GLsizei count) {
+  glDrawArrays(mode, first, count);
+}
+void EnableVertexAttribArray(PP_Resource, GLuint index) {
+  glEnableVertexAttribArray(index);
+}
+void Finish(PP_Resource) {
+  glFinish();
+}
+void Flush(PP_Resource) {
+  glFlush();
+}
+void GenBuffers(PP_Resource, GLsizei n, GLuint* buffers) {
+  glGenBuffers(n, buffers);
+}
+void GenTextures(PP_Resource, GLsizei n, GLuint* textures) {
+  glGenTextures(n, textures);
+}
+GLint GetAttribLocation(PP_Resource, GLuint program, const char* name) {
+  return glGetAttribLocation(program, name);
+}
+GLenum GetError(PP_Resource) {
+  return glGetError();
+}
+void GetIntegerv(PP_Resource, GLenum pname, GLint* params) {
+  glGetIntegerv(pname, params);
+}
+GLint GetUniformLocation(PP_Resource, GLuint program, const char* name) {
+  return glGetUniformLocation(program, name);
+}
+void LinkProgram(PP_Resource, GLuint program) {
+  glLinkProgram(program);
+}
+void PixelStorei(PP_Resource, GLenum pname, GLint param) {
+  glPixelStorei(pname, param);
+}
+void ShaderSource(PP_Resource, GLuint shader, GLsizei count,
+                  const char** str, const GLint* length) {
+  glShaderSource(shader, count, str, length);
+}
+void TexImage2D(PP_Resource, GLenum target, GLint level,
+                GLint internalformat, GLsizei width, GLsizei height,
+                GLint border, GLenum format, GLenum type,
+                const void* pixels) {
+  glTexImage2D(target, level, internalformat, width, height, border, format,
+               type, pixels);
+}
+void TexParameteri(PP_Resource, GLenum target, GLenum pname, GLint param) {
+  glTexParameteri(target, pname, param);
+}
+void TexSubImage2D(PP_Resource, GLenum target, GLint level, GLint xoffset,
+                   GLint yoffset, GLsizei width, GLsizei height,
+                   GLenum format, GLenum type, const void* pixels) {
+  glTexSubImage2D(target, level, xoffset, yoffset, width, height, format,
+                  type, pixels);
+}
+void Uniform1f(PP_Resource, GLint location, GLfloat x) {
+  glUniform1f(location, x);
+}
+void Uniform1i(PP_Resource, GLint location, GLint x) {
+  glUniform1i(location, x);
+}
+void Uniform2f(PP_Resource, GLint location, GLfloat x, GLfloat y) {
+  glUniform2f(location, x, y);
+}
+void UseProgram(PP_Resource, GLuint program) {
+  glUseProgram(program);
+}
+void VertexAttribPointer(PP_Resource, GLuint index, GLint size, GLenum type,
+                         GLboolean normalized, GLsizei stride,
+                         const void* ptr) {
+  glVertexAttribPointer(index, size, type, normalized, stride, ptr);
+}
+void Viewport(PP_Resource, GLint x, GLint y, GLsizei width,
+              GLsizei height) {
+  glViewport(x, y, width, height);
+}
+
+PPB_OpenGLES2 BuildTable() {
+  PPB_OpenGLES2 table;
+  memset(&table, 0, sizeof(table));
+  table.ActiveTexture = &ActiveTexture;
+  table.AttachShader = &AttachShader;
+  table.BindAttribLocation = &BindAttribLocation;
+  table.BindBuffer = &BindBuffer;
+  table.BindTexture = &BindTexture;
+  table.BufferData = &BufferData;
+  table.Clear = &Clear;
+  table.ClearColor = &ClearColor;
+  table.CompileShader = &CompileShader;
+  table.CreateProgram = &CreateProgram;
+  table.CreateShader = &CreateShader;
+  table.DeleteBuffers = &DeleteBuffers;
+  table.DeleteProgram = &DeleteProgram;
+  table.DeleteShader = &DeleteShader;
+  table.DeleteTextures = &DeleteTextures;
+  table.DrawArrays = &DrawArrays;
+  table.EnableVertexAttribArray = &EnableVertexAttribArray;
+  table.Finish = &Finish;
+  table.Flush = &Flush;
+  table.GenBuffers = &GenBuffers;
+  table.GenTextures = &GenTextures;
+  table.GetAttribLocation = &GetAttribLocation;
+  table.GetError = &GetError;
+  table.GetIntegerv = &GetIntegerv;
+  table.GetUniformLocation = &GetUniformLocation;
+  table.LinkProgram = &LinkProgram;
+  table.PixelStorei = &PixelStorei;
+  table.ShaderSource = &ShaderSource;
+  table.TexImage2D = &TexImage2D;
+  table.TexParameteri = &TexParameteri;
+  table.TexSubImage2D = &TexSubImage2D;
+  table.Uniform1f = &Uniform1f;
+  table.Uniform1i = &Uniform1i;
+  table.Uniform2f = &Uniform2f;
+  table.UseProgram = &UseProgram;
+  table.VertexAttribPointer = &VertexAttribPointer;
+  table.Viewport = &Viewport;
+  return table;
+}
+
+const PPB_OpenGLES2 kTable = BuildTable();
+
+bool HasExtension(const char* extensions, const char* name) {
+  return extensions && strstr(extensions, name);
+}
+
+}  // namespace
+
+GLBackendEgl::GLBackendEgl()
+    : display_(EGL_NO_DISPLAY),
+      context_(EGL_NO_CONTEXT),
+      surface_(EGL_NO_SURFACE),
+      framebuffer_(0),
+      target_(0) {
+}
+
+GLBackendEgl::~GLBackendEgl() {
+  if (display_ == EGL_NO_DISPLAY)
+    return;
+  eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (context_ != EGL_NO_CONTEXT)
+    eglDestroyContext(display_, context_);
+  if (surface_ != EGL_NO_SURFACE)
+    eglDestroySurface(display_, surface_);
+  eglTerminate(display_);
+}
+
+// Mesa's surfaceless platform needs neither a GPU nor a display server,
+// other EGL implementations get a 1x1 pbuffer when they cannot make a
+// context current without a surface.
+bool GLBackendEgl::Init() {
+  const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+      reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+          eglGetProcAddress("eglGetPlatformDisplayEXT"));
+  if (get_platform_display &&
+      HasExtension(client_extensions, "EGL_MESA_platform_surfaceless")) {
+    display_ = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                    EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (display_ == EGL_NO_DISPLAY)
+    display_ = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display_ == EGL_NO_DISPLAY || !eglInitialize(display_, NULL, NULL)) {
+    fprintf(stderr, "EGL: no display\n");
+    display_ = EGL_NO_DISPLAY;
+    return false;
+  }
+  eglBindAPI(EGL_OPENGL_ES_API);
+
+  bool surfaceless = HasExtension(eglQueryString(display_, EGL_EXTENSIONS),
+                                  "EGL_KHR_surfaceless_context");
+  const EGLint config_attributes[] = {
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+    EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+    EGL_NONE,
+  };
+  const EGLint context_attributes[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE,
+  };
+  EGLConfig config;
+  EGLint configs = 0;
+  if (!eglChooseConfig(display_, config_attributes, &config, 1, &configs) ||
+      configs < 1) {
+    fprintf(stderr, "EGL: no GLES2 config\n");
+    return false;
+  }
+  context_ = eglCreateContext(display_, config, EGL_NO_CONTEXT,
+                              context_attributes);
+  if (context_ == EGL_NO_CONTEXT) {
+    fprintf(stderr, "EGL: no GLES2 context\n");
+    return false;
+  }
+  if (!surfaceless) {
+    const EGLint pbuffer_attributes[] = {
+      EGL_WIDTH, 1,
+      EGL_HEIGHT, 1,
+      EGL_NONE,
+    };
+    surface_ = eglCreatePbufferSurface(display_, config, pbuffer_attributes);
+  }
+  if (!eglMakeCurrent(display_, surface_, surface_, context_)) {
+    fprintf(stderr, "EGL: cannot make the context current\n");
+    return false;
+  }
+  glGenFramebuffers(1, &framebuffer_);
+  return true;
+}
+
+bool GLBackendEgl::Resize(int width, int height) {
+  if (target_)
+    glDeleteTextures(1, &target_);
+  glGenTextures(1, &target_);
+  glBindTexture(GL_TEXTURE_2D, target_);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, NULL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         target_, 0);
+  return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void GLBackendEgl::Finish() {
+  glFinish();
+}
+
+const PPB_OpenGLES2* GLBackendEgl::gl() const {
+  return &kTable;
+}
+
+const char* GLBackendEgl::renderer() const {
+  return reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+}
@@ -0,0 +1,43 @@
+/*
+ * gl_backend_egl.h
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#ifndef PPAPI_GSTREAMER_GL_BACKEND_EGL_H_
+#define PPAPI_GSTREAMER_GL_BACKEND_EGL_H_
+
+#include <EGL/egl.h>
+
+#include "ppapi/c/pp_resource.h"
+#include "ppapi/c/ppb_opengles2.h"
+
+// Offscreen GLES2 for the render benchmark: a surfaceless EGL context
+// (Mesa llvmpipe on a GPU-less machine) drawing into a framebuffer object,
+// behind the same PPB_OpenGLES2 table the browser gives the plugin. The
+// table calls libGLESv2 directly and ignores the PP_Resource it is given,
+// only the entries TextureRenderer uses are filled.
+class GLBackendEgl {
+ public:
+  GLBackendEgl();
+  ~GLBackendEgl();
+
+  bool Init();
+  // (Re)creates the width x height RGBA draw target.
+  bool Resize(int width, int height);
+  // Waits for the rendering to complete.
+  void Finish();
+
+  const PPB_OpenGLES2* gl() const;
+  PP_Resource context() const { return 1; }
+  const char* renderer() const;
+
+ private:
+  EGLDisplay display_;
+  EGLContext context_;
+  EGLSurface surface_;
+  unsigned framebuffer_;
+  unsigned target_;
+};
+
+#endif  // PPAPI_GSTREAMER_GL_BACKEND_EGL_H_
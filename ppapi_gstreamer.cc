@@ -2,14 +2,22 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "ppapi/c/pp_errors.h"
 #include "ppapi/c/ppb_opengles2.h"
+#include "ppapi/cpp/audio.h"
+#include "ppapi/cpp/audio_config.h"
 #include "ppapi/cpp/core.h"
 #include "ppapi/cpp/fullscreen.h"
 #include "ppapi/cpp/graphics_3d.h"
@@ -19,6 +27,9 @@
 #include "ppapi/cpp/module.h"
 #include "ppapi/cpp/rect.h"
 #include "ppapi/cpp/var.h"
+#include "ppapi/cpp/var_array_buffer.h"
+#include "ppapi/cpp/var_dictionary.h"
+#include "ppapi/cpp/view.h"
 #include "base/memory/scoped_ptr.h"
 #include "ppapi/proxy/plugin_resource.h"
 #include "ppapi/proxy/ppapi_proxy_export.h"
@@ -34,6 +45,8 @@
 
 #include "ppapi/utility/completion_callback_factory.h"
 
+#include "texture_renderer.h"
+#include "thumbnail_gstreamer.h"
 #include "video_decoder_gstreamer.h"
 
 
@@ -55,12 +68,181 @@ using ppapi::thunk::PPB_Graphics3D_API;
 
 namespace {
 
-struct Shader {
-  Shader() : program(0), texcoord_scale_location(0) {}
-  ~Shader() {}
+// Mosaic mode: tile size used when the embed does not give "mosaic-tile".
+const int kMosaicDefaultTileWidth = 320;
+const int kMosaicDefaultTileHeight = 240;
+const int kMosaicMaxQueued = 3;
+
+// How long the texture render loops wait before polling the decoders
+// again when no new frame was available.
+const int32_t kFramePollMs = 5;
+
+// Visibility: how long a hidden player keeps its pipeline running before
+// being parked, and the resume latency above which a warning is logged.
+const int32_t kDefaultParkDelayMs = 10000;
+const double kResumeTargetSec = 0.5;
+
+// Timeshift ring size when "timeshift-size-mb" is not given, a few minutes
+// of an SD MPEG-TS service.
+const uint64_t kTimeshiftDefaultSizeMb = 256;
+
+// PPAPI audio output: ring size when "audio-ring-ms" is not given, its
+// largest accepted value, and the device buffer asked for (the browser may
+// pick another one).
+const int32_t kAudioDefaultRingMs = 200;
+const int32_t kAudioMaxRingMs = 5000;
+const uint32_t kAudioSampleFrames = 512;
+
+// Size of the preview frames returned by thumbnail() and thumbnails().
+const int kThumbnailDefaultWidth = 160;
+const int kThumbnailDefaultHeight = 90;
+
+// Size the single-stream texture mode decodes to.
+const int kFrameWidth = 320;
+const int kFrameHeight = 240;
+
+// Interval between two performance log lines.
+const double kStatsIntervalSec = 5.0;
+
+// PPAPI entry points taking longer than this are reported.
+const double kMainThreadBudgetSec = 0.004;
+
+// CPU time (user + system) consumed by the whole plugin process, which
+// includes the GStreamer streaming threads.
+static double ProcessCpuTime() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Context switches of the whole plugin process, each one a thread waking
+// up or being preempted.
+static long ProcessWakeups() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// Counts events (presented frames, paints...) and logs their rate together
+// with the process CPU usage and wakeups every kStatsIntervalSec.
+class RateCounter {
+ public:
+  explicit RateCounter(const char* name)
+      : name_(name), count_(0), start_(0), cpu_start_(0), wakeups_start_(0) {}
+
+  // Returns true when an interval has just been logged.
+  bool Tick() {
+    count_++;
+    return Poll();
+  }
+
+  // Logs when an interval is over, also when nothing was counted in it.
+  bool Poll() {
+    PP_TimeTicks now = pp::Module::Get()->core()->GetTimeTicks();
+    if (start_ == 0) {
+      start_ = now;
+      cpu_start_ = ProcessCpuTime();
+      wakeups_start_ = ProcessWakeups();
+      return false;
+    }
+    double elapsed = now - start_;
+    if (elapsed < kStatsIntervalSec)
+      return false;
+    double cpu = ProcessCpuTime();
+    long wakeups = ProcessWakeups();
+    printf("--[STATS] %s: %.1f/s cpu %.1f%% wakeups %.1f/s\n", name_,
+           count_ / elapsed, 100.0 * (cpu - cpu_start_) / elapsed,
+           (wakeups - wakeups_start_) / elapsed);
+    count_ = 0;
+    start_ = now;
+    cpu_start_ = cpu;
+    wakeups_start_ = wakeups;
+    return true;
+  }
+
+ private:
+  const char* name_;
+  unsigned count_;
+  PP_TimeTicks start_;
+  double cpu_start_;
+  long wakeups_start_;
+};
+
+// GL commands and main thread time spent per presented frame, logged with
+// the RateCounter of the frames.
+class FrameCost {
+ public:
+  FrameCost() : frames_(0), commands_(0), seconds_(0) {}
+
+  void Add(unsigned commands, double seconds) {
+    frames_++;
+    commands_ += commands;
+    seconds_ += seconds;
+  }
+
+  void Log(const char* name) {
+    if (!frames_)
+      return;
+    printf("--[STATS] %s: %.1f GL commands/frame, main thread %.3f ms/frame\n",
+           name, static_cast<double>(commands_) / frames_,
+           seconds_ * 1000 / frames_);
+    frames_ = 0;
+    commands_ = 0;
+    seconds_ = 0;
+  }
+
+ private:
+  unsigned frames_;
+  unsigned commands_;
+  double seconds_;
+};
+
+// Resident set size of the plugin process, in bytes.
+static unsigned ProcessRss() {
+  unsigned long pages_total = 0, pages_resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  if (fscanf(statm, "%lu %lu", &pages_total, &pages_resident) != 2)
+    pages_resident = 0;
+  fclose(statm);
+  return pages_resident * sysconf(_SC_PAGESIZE);
+}
 
-  GLuint program;
-  GLint texcoord_scale_location;
+// Measures how long a PPAPI entry point blocks the main thread, logs the
+// worst case seen so far and warns when kMainThreadBudgetSec is exceeded.
+class MainThreadTimer {
+ public:
+  explicit MainThreadTimer(const char* name)
+      : name_(name), start_(pp::Module::Get()->core()->GetTimeTicks()) {}
+
+  ~MainThreadTimer() {
+    static double max_blocked = 0;
+    double blocked = pp::Module::Get()->core()->GetTimeTicks() - start_;
+    if (blocked > max_blocked)
+      max_blocked = blocked;
+    if (blocked > kMainThreadBudgetSec) {
+      printf("--[STATS] %s blocked the main thread %.2f ms (max %.2f ms)\n",
+             name_, blocked * 1000, max_blocked * 1000);
+    }
+  }
+
+ private:
+  const char* name_;
+  PP_TimeTicks start_;
+};
+
+struct MosaicTile {
+  MosaicTile() : decoder(NULL), drop_policy(VIDEO_DECODER_DROP_TO_LATEST),
+                 presented(0) {}
+
+  void *decoder;
+  std::string src;
+  VideoDecoderDropPolicy drop_policy;
+  unsigned presented;
 };
 
 class PPAPIGstreamerInstance : public pp::Instance,
@@ -72,6 +254,7 @@ class PPAPIGstreamerInstance : public pp::Instance,
   // pp::Instance implementation (see PPP_Instance).
   virtual bool Init(uint32_t argc, const char* argn[], const char* argv[]);
 
+  virtual void DidChangeView(const pp::View& view);
   virtual void DidChangeView(const pp::Rect& position,
                              const pp::Rect& clip_ignored);
 
@@ -82,6 +265,10 @@ class PPAPIGstreamerInstance : public pp::Instance,
     // For now, just delete it and construct+bind a new context.
     delete context_;
     context_ = NULL;
+    renderer_.SetContext(0);
+    overlay_visible_ = false;
+    colorkey_swap_pending_ = false;
+    paint_pending_ = false;
     printf("--[CPR] [Graphics3DContextLost]\n");
     pp::CompletionCallback cb = callback_factory_.NewCallback(
         &PPAPIGstreamerInstance::InitGL);
@@ -92,12 +279,24 @@ class PPAPIGstreamerInstance : public pp::Instance,
     if (event.GetType() == PP_INPUTEVENT_TYPE_MOUSEUP) {
       fullscreen_ = !fullscreen_;
       pp::Fullscreen(this).SetFullscreen(fullscreen_);
+      DamageColorKey();
     }
     return true;
   }
 
    virtual void HandleMessage(const pp::Var& var_message);
 
+  // VideoDecoderCommandDone, called on the decoder worker thread.
+  static void CommandDone(void* user_data, VideoDecoderCommand command,
+                          int32_t result);
+  // ThumbnailReady, called on the thumbnail worker thread.
+  static void ThumbnailsReady(void* user_data);
+  // VideoDecoderAbrSwitch, called on the decoder worker thread.
+  static void AbrSwitch(void* user_data, const VideoDecoderAbrEvent* event);
+  // PPB_Audio_Callback, called on the audio device thread.
+  static void AudioCallback(void* samples, uint32_t size, PP_TimeDelta latency,
+                            void* user_data);
+
 //if NO_HOLE
    void PaintPicture(int32_t result);
 //#endif //NO_HOLE
@@ -106,8 +305,36 @@ class PPAPIGstreamerInstance : public pp::Instance,
 
   // GL-related functions.
   void InitGL(int32_t result);
-  void FlickerAndPaint(int32_t result);
+
+  // Hole mode: the colorkey is only repainted when damaged (view change,
+  // resize, context loss, fullscreen toggle), the loop is idle otherwise.
+  void DamageColorKey();
+  void PaintColorKey(int32_t result);
+  void ColorKeySwapped(int32_t result);
+  // Logs colorkey_paints_ every kStatsIntervalSec, idle or not.
+  void ColorKeyStats(int32_t result);
   bool StartPlay();
+  void PostCommandDone(int32_t result, VideoDecoderCommand command);
+  void PostThumbnails(int32_t result);
+  void PostMemoryStats();
+  void PostAbrSwitch(int32_t result, VideoDecoderAbrEvent event);
+  void UpdateAbrCeiling();
+  void StartAudio();
+
+  // Visibility driven power states. Hidden: no rendering and no frame
+  // handoff, video decode optionally skipped. Parked (after park_delay_ms_
+  // hidden): the pipeline goes to PAUSED or READY, keeping its position.
+  enum Visibility { kVisible, kHidden, kParked };
+  void SetVisibility(Visibility visibility);
+  void ParkIfHidden(int32_t generation);
+  void StartRenderLoop();
+  void ResumeDone(const char* what);
+  std::vector<void*> Decoders();
+
+  // Mosaic mode, see MosaicTile.
+  bool StartMosaic();
+  bool MosaicFitsTexture();
+  void MosaicPaint(int32_t result);
 
   pp::Size plugin_size_;
   pp::Rect windowrect;
@@ -124,6 +351,60 @@ class PPAPIGstreamerInstance : public pp::Instance,
   bool fullscreen_;
   void *videodecodergstreamer_;
   std::string src_;
+  unsigned memory_budget_;
+  std::string timeshift_path_;
+  uint64_t timeshift_size_;
+  std::string capture_path_;
+  bool capture_payload_;
+  // Adaptive streaming: variants are capped to the displayed video size
+  // and to abr_max_bitrate_ (0: unlimited).
+  bool abr_;
+  uint64_t abr_max_bitrate_;
+  // Audio played through PPB_Audio, mixed by the browser, instead of the
+  // native audio sink.
+  bool ppapi_audio_;
+  int32_t audio_ring_ms_;
+  pp::Audio audio_;
+
+  // Textures the single-stream and mosaic frames are uploaded to.
+  TextureRenderer renderer_;
+  // Single-stream textures uploaded to in turn, see
+  // TextureRenderer::SetFrameFormat.
+  int texture_pool_;
+  bool use_hole_;
+  RateCounter frames_fps_;
+  FrameCost frame_cost_;
+
+  // VIDEO_DECODER_SUBTITLES_GPU: subtitles are uploaded to their own
+  // texture when they change and blended by the fragment shader.
+  VideoDecoderSubtitles subtitles_;
+  bool overlay_visible_;
+
+  Visibility visibility_;
+  int32_t visibility_generation_;
+  int32_t park_delay_ms_;
+  bool park_to_ready_;
+  bool hidden_skip_decode_;
+  bool paint_pending_;
+  PP_TimeTicks visibility_since_;
+  double visibility_cpu_since_;
+  PP_TimeTicks resume_start_;
+
+  std::vector<MosaicTile> mosaic_;
+  int mosaic_columns_;
+  int mosaic_rows_;
+  pp::Size mosaic_tile_size_;
+  // stop() released the tiles, playPause() initializes them again.
+  bool mosaic_stopped_;
+  RateCounter mosaic_fps_;
+
+  void *thumbnailer_;
+  pp::Size thumbnail_size_;
+
+  bool colorkey_damaged_;
+  bool colorkey_swap_pending_;
+  bool colorkey_stats_started_;
+  RateCounter colorkey_paints_;
 
 #ifdef GST_PPAPI_NO_HOLE
   ppapi::ScopedPPResource graphics3d_;
@@ -131,13 +412,9 @@ class PPAPIGstreamerInstance : public pp::Instance,
   gpu::gles2::GLES2Implementation* gles2_impl_;
   //std::vector<gpu::Mailbox>& mailboxes;
 
-  // Shader program to draw GL_TEXTURE_2D target.
-  Shader shader_2d_;
-
-  void Create2DProgramOnce();
-  Shader CreateProgram(const char* vertex_shader,
-                                 const char* fragment_shader);
-  void CreateShader(GLuint program, GLenum type, const char* source, int size);
+  // Returns true when the overlay or its visibility changed.
+  bool UpdateOverlay();
+  void ReportTextureBytes();
   void processbuffer(void *buffer, int size);
 //#endif //NO_HOLE
 };
@@ -150,7 +427,40 @@ PPAPIGstreamerInstance::PPAPIGstreamerInstance(PP_Instance instance, pp::Module*
       module_(module),
       context_(NULL),
       fullscreen_(false),
-      videodecodergstreamer_(NULL)
+      videodecodergstreamer_(NULL),
+      memory_budget_(0),
+      timeshift_size_(kTimeshiftDefaultSizeMb << 20),
+      capture_payload_(true),
+      abr_(true),
+      abr_max_bitrate_(0),
+      ppapi_audio_(false),
+      audio_ring_ms_(kAudioDefaultRingMs),
+      renderer_(gles2_if_, 0),
+      texture_pool_(1),
+      use_hole_(true),
+      frames_fps_("frames"),
+      subtitles_(VIDEO_DECODER_SUBTITLES_OFF),
+      overlay_visible_(false),
+      visibility_(kVisible),
+      visibility_generation_(0),
+      park_delay_ms_(kDefaultParkDelayMs),
+      park_to_ready_(false),
+      hidden_skip_decode_(false),
+      paint_pending_(false),
+      visibility_since_(0),
+      visibility_cpu_since_(0),
+      resume_start_(0),
+      mosaic_columns_(0),
+      mosaic_rows_(0),
+      mosaic_tile_size_(kMosaicDefaultTileWidth, kMosaicDefaultTileHeight),
+      mosaic_stopped_(false),
+      mosaic_fps_("mosaic"),
+      thumbnailer_(NULL),
+      thumbnail_size_(kThumbnailDefaultWidth, kThumbnailDefaultHeight),
+      colorkey_damaged_(false),
+      colorkey_swap_pending_(false),
+      colorkey_stats_started_(false),
+      colorkey_paints_("colorkey paints")
 {
   printf("--[CPR] PPAPIGstreamerInstance\n");
 
@@ -178,96 +488,47 @@ PPAPIGstreamerInstance::PPAPIGstreamerInstance(PP_Instance instance, pp::Module*
 
 PPAPIGstreamerInstance::~PPAPIGstreamerInstance() {
   delete context_;
-  VideoDecoderGstreamer_release(videodecodergstreamer_);
+  // Returns once the callback is done with the decoder.
+  if (!audio_.is_null())
+    audio_.StopPlayback();
+  if (thumbnailer_)
+    ThumbnailGstreamer_destroy(thumbnailer_);
+  if (videodecodergstreamer_)
+    VideoDecoderGstreamer_destroy(videodecodergstreamer_);
+  for (size_t i = 0; i < mosaic_.size(); i++) {
+    if (mosaic_[i].decoder)
+      VideoDecoderGstreamer_destroy(mosaic_[i].decoder);
+  }
 
 }
 
 
 //--------------------------
 //if NO_HOLE
-void PPAPIGstreamerInstance::CreateShader(GLuint program,
-                              GLenum type,
-                              const char* source,
-                              int size) {
-  GLuint shader = gles2_if_->CreateShader(context_->pp_resource(), type);
-  gles2_if_->ShaderSource(context_->pp_resource(), shader, 1, &source, &size);
-  gles2_if_->CompileShader(context_->pp_resource(), shader);
-  gles2_if_->AttachShader(context_->pp_resource(), program, shader);
-  gles2_if_->DeleteShader(context_->pp_resource(), shader);
-}
-
-Shader PPAPIGstreamerInstance::CreateProgram(const char* vertex_shader,
-                                 const char* fragment_shader) {
-  Shader shader;
-
-  // Create shader program.
-  shader.program = gles2_if_->CreateProgram(context_->pp_resource());
-  CreateShader(
-      shader.program, GL_VERTEX_SHADER, vertex_shader, strlen(vertex_shader));
-  CreateShader(shader.program,
-               GL_FRAGMENT_SHADER,
-               fragment_shader,
-               strlen(fragment_shader));
-  gles2_if_->LinkProgram(context_->pp_resource(), shader.program);
-  gles2_if_->UseProgram(context_->pp_resource(), shader.program);
-  gles2_if_->Uniform1i(
-      context_->pp_resource(),
-      gles2_if_->GetUniformLocation(
-          context_->pp_resource(), shader.program, "s_texture"),
-      0);
-  assertNoGLError();
-
-  shader.texcoord_scale_location = gles2_if_->GetUniformLocation(
-      context_->pp_resource(), shader.program, "v_scale");
-
-  GLint pos_location = gles2_if_->GetAttribLocation(
-      context_->pp_resource(), shader.program, "a_position");
-  GLint tc_location = gles2_if_->GetAttribLocation(
-      context_->pp_resource(), shader.program, "a_texCoord");
-  assertNoGLError();
-
-  gles2_if_->EnableVertexAttribArray(context_->pp_resource(), pos_location);
-  gles2_if_->VertexAttribPointer(
-      context_->pp_resource(), pos_location, 2, GL_FLOAT, GL_FALSE, 0, 0);
-  gles2_if_->EnableVertexAttribArray(context_->pp_resource(), tc_location);
-  gles2_if_->VertexAttribPointer(
-      context_->pp_resource(),
-      tc_location,
-      2,
-      GL_FLOAT,
-      GL_FALSE,
-      0,
-      static_cast<float*>(0) + 8);  // Skip position coordinates.
-
-  gles2_if_->UseProgram(context_->pp_resource(), 0);
-  assertNoGLError();
-  return shader;
-}
-
-static const char kVertexShader[] =
-    "varying vec2 v_texCoord;            \n"
-    "attribute vec4 a_position;          \n"
-    "attribute vec2 a_texCoord;          \n"
-    "uniform vec2 v_scale;               \n"
-    "void main()                         \n"
-    "{                                   \n"
-    "    v_texCoord = v_scale * a_texCoord; \n"
-    "    gl_Position = a_position;       \n"
-    "}";
-
-void PPAPIGstreamerInstance::Create2DProgramOnce() {
-  if (shader_2d_.program)
-    return;
-  static const char kFragmentShader2D[] =
-      "precision mediump float;            \n"
-      "varying vec2 v_texCoord;            \n"
-      "uniform sampler2D s_texture;        \n"
-      "void main()                         \n"
-      "{"
-      "    gl_FragColor = texture2D(s_texture, v_texCoord); \n"
-      "}";
-  shader_2d_ = CreateProgram(kVertexShader, kFragmentShader2D);
-  assertNoGLError();
+// Uploads the subtitle overlay to texture unit 1, only when it changed.
+bool PPAPIGstreamerInstance::UpdateOverlay()
+{
+    bool visible = false;
+    void *overlay = VideoDecoderGstreamer_getOverlay(videodecodergstreamer_,
+                                                     &visible);
+    bool changed = overlay || visible != overlay_visible_;
+
+    if (overlay) {
+        unsigned bytes = renderer_.TextureBytes();
+        renderer_.UploadOverlay(overlay);
+        if (renderer_.TextureBytes() != bytes)
+            ReportTextureBytes();
+        free(overlay);
+    }
+    // Not drawn until uploaded once, see TextureRenderer::DrawOverlay.
+    overlay_visible_ = visible;
+    return changed;
+}
+
+void PPAPIGstreamerInstance::ReportTextureBytes()
+{
+    VideoDecoderGstreamer_setTextureBytes(videodecodergstreamer_,
+                                          renderer_.TextureBytes());
 }
 
 
@@ -275,113 +536,240 @@ void PPAPIGstreamerInstance::Create2DProgramOnce() {
 //----------------------------
 void PPAPIGstreamerInstance::processbuffer(void *buffer, int size)
 {
-    int x = 0;
-    int y = 0;
-    int half_width = plugin_size_.width() ;
-    int half_height = plugin_size_.height() ;
-    uint32_t texture;
-    PP_VideoPicture *picture = new PP_VideoPicture;
-    picture->decode_id = 0;
-    picture->texture_target = GL_TEXTURE_2D;
-    picture->texture_size = plugin_size_;
-
-#if 0
-    //create texture
-    gles2_impl_->GenTextures(1, &texture);
-    picture->texture_id = texture;
-    gles2_impl_->ActiveTexture(GL_TEXTURE0);
-    gles2_impl_->BindTexture(GL_TEXTURE_2D, texture);
-
-    gles2_impl_->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    gles2_impl_->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    gles2_impl_->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    gles2_impl_->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    gles2_impl_->TexImage2D(picture->texture_target,
-                          0, //level
-                          GL_RGBA, //internalformat
-                          plugin_size_.width(),
-                          plugin_size_.height(),
-                          0, //border
-                          GL_RGBA, //format
-                          GL_UNSIGNED_BYTE, //type
-                          buffer); //data
-
-    //gles2_if_->TexImage2D (GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA16F_EXT, meta->width, meta->height, 0,
-    //    GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-#endif
-    gles2_if_->GenTextures(context_->pp_resource(), 1, &texture);
-    picture->texture_id = texture;
-    gles2_if_->ActiveTexture(context_->pp_resource(), GL_TEXTURE0);
-    gles2_if_->BindTexture(context_->pp_resource(), GL_TEXTURE_2D, texture);
-
-    gles2_if_->TexParameteri(context_->pp_resource(), GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    gles2_if_->TexParameteri(context_->pp_resource(), GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    gles2_if_->TexParameteri(context_->pp_resource(), GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    gles2_if_->TexParameteri(context_->pp_resource(), GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    gles2_if_->TexImage2D(context_->pp_resource(),
-                    picture->texture_target,
-                          0, //level
-                          GL_RGBA, //internalformat
-                          plugin_size_.width(),
-                          plugin_size_.height(),
-                          0, //border
-                          GL_RGBA, //format
-                          GL_UNSIGNED_BYTE, //type
-                          buffer); //data
-
-    //
-    Create2DProgramOnce();
-    gles2_if_->UseProgram(context_->pp_resource(), shader_2d_.program);
-    gles2_if_->Uniform2f(
-        context_->pp_resource(), shader_2d_.texcoord_scale_location, 1.0, 1.0);
-
-    gles2_if_->Viewport(context_->pp_resource(), x, y, half_width, half_height);
-    gles2_if_->ActiveTexture(context_->pp_resource(), GL_TEXTURE0);
-    gles2_if_->BindTexture(
-        context_->pp_resource(), picture->texture_target, picture->texture_id);
-    gles2_if_->DrawArrays(context_->pp_resource(), GL_TRIANGLE_STRIP, 0, 4);
-
-    gles2_if_->UseProgram(context_->pp_resource(), 0);
+    if (size < kFrameWidth * kFrameHeight * 3) {
+        free(buffer);
+        return;
+    }
+
+    renderer_.SetFrameFormat(kFrameWidth, kFrameHeight, GL_RGB,
+                             texture_pool_, GL_NEAREST);
+    if (subtitles_ == VIDEO_DECODER_SUBTITLES_GPU)
+        UpdateOverlay();
 
+    unsigned bytes = renderer_.TextureBytes();
+    renderer_.UploadFrame(buffer);
+    if (renderer_.TextureBytes() != bytes)
+        ReportTextureBytes();
+
+    if (subtitles_ == VIDEO_DECODER_SUBTITLES_GPU) {
+        renderer_.DrawOverlay(plugin_size_.width(), plugin_size_.height(),
+                              overlay_visible_);
+    } else {
+        renderer_.Draw(plugin_size_.width(), plugin_size_.height());
+    }
 
     free(buffer);
 }
 
 void PPAPIGstreamerInstance::PaintPicture(int32_t result) {
     int size = 0;
-   if (result != 0 || !context_)
+    paint_pending_ = false;
+   if (result != 0 || !context_ || visibility_ != kVisible)
        return;
 printf("--[CPR] PaintPicture  ---%d\n",__LINE__);
 
 
+    PP_TimeTicks start = module_->core()->GetTimeTicks();
+    pp::CompletionCallback cb = callback_factory_.NewCallback(
+            &PPAPIGstreamerInstance::PaintPicture);
+    paint_pending_ = true;
     void *buf = VideoDecoderGstreamer_getBuffer(videodecodergstreamer_, &size);
     if (buf) {
         printf("--[CPR] PaintPicture  buffer present---%d\n",__LINE__);
 
         //CreateTextures();
         processbuffer(buf, size);
-        pp::CompletionCallback cb = callback_factory_.NewCallback(
-                &PPAPIGstreamerInstance::PaintPicture);
         context_->SwapBuffers(cb);
-        assertNoGLError();
-    } else
-        PaintPicture(0); //???? A voir retour
+        frame_cost_.Add(renderer_.TakeCommands(),
+                        module_->core()->GetTimeTicks() - start);
+        // GetError is a synchronous round trip to the GPU process, GL
+        // errors are sticky so checking once per stats interval is enough.
+        if (frames_fps_.Tick()) {
+            frame_cost_.Log("frames");
+            assertNoGLError();
+        }
+        ResumeDone("first frame");
+    } else if (subtitles_ == VIDEO_DECODER_SUBTITLES_GPU &&
+               renderer_.TextureBytes() && UpdateOverlay()) {
+        // No new frame (paused, or a still picture): subtitles still come
+        // and go over the last one.
+        renderer_.DrawOverlay(plugin_size_.width(), plugin_size_.height(),
+                              overlay_visible_);
+        context_->SwapBuffers(cb);
+    } else {
+        module_->core()->CallOnMainThread(kFramePollMs, cb, 0);
+    }
 }
 
 //#endif //NO_HOLE
 
+// All tiles live in one RGB texture atlas of mosaic_columns_ x mosaic_rows_
+// tiles. Every stream is scaled to the tile size by the pipeline, so a new
+// frame is a single TexSubImage2D into its tile, and the whole atlas is
+// presented with one draw and one SwapBuffers.
+void PPAPIGstreamerInstance::MosaicPaint(int32_t result)
+{
+    paint_pending_ = false;
+    if (result != 0 || !context_ || visibility_ != kVisible)
+        return;
 
-bool PPAPIGstreamerInstance::StartPlay()
+    PP_TimeTicks start = module_->core()->GetTimeTicks();
+    int tile_width = mosaic_tile_size_.width();
+    int tile_height = mosaic_tile_size_.height();
+    bool damaged = false;
+
+    renderer_.SetFrameFormat(mosaic_columns_ * tile_width,
+                             mosaic_rows_ * tile_height, GL_RGB, 1, GL_LINEAR);
+    bool allocated = renderer_.TextureBytes();
+    for (size_t i = 0; i < mosaic_.size(); i++) {
+        int size = 0;
+        void *buf = VideoDecoderGstreamer_getBuffer(mosaic_[i].decoder, &size);
+        if (!buf)
+            continue;
+        if (size >= tile_width * tile_height * 3) {
+            renderer_.UploadFrameRect((i % mosaic_columns_) * tile_width,
+                                      (i / mosaic_columns_) * tile_height,
+                                      tile_width, tile_height, buf);
+            mosaic_[i].presented++;
+            damaged = true;
+        }
+        free(buf);
+    }
+    if (!allocated && renderer_.TextureBytes()) {
+        for (size_t i = 0; i < mosaic_.size(); i++) {
+            VideoDecoderGstreamer_setTextureBytes(mosaic_[i].decoder,
+                    tile_width * tile_height * 3);
+        }
+    }
+
+    pp::CompletionCallback cb = callback_factory_.NewCallback(
+            &PPAPIGstreamerInstance::MosaicPaint);
+    paint_pending_ = true;
+    if (!damaged) {
+        module_->core()->CallOnMainThread(kFramePollMs, cb, 0);
+        return;
+    }
+
+    renderer_.Draw(plugin_size_.width(), plugin_size_.height());
+    context_->SwapBuffers(cb);
+    frame_cost_.Add(renderer_.TakeCommands(),
+                    module_->core()->GetTimeTicks() - start);
+
+    if (mosaic_fps_.Tick()) {
+        for (size_t i = 0; i < mosaic_.size(); i++) {
+            unsigned frames = 0, dropped = 0;
+            VideoDecoderGstreamer_getStats(mosaic_[i].decoder, &frames, &dropped);
+            printf("--[STATS] mosaic tile %u: decoded %u dropped %u presented %u\n",
+                   (unsigned)i, frames, dropped, mosaic_[i].presented);
+        }
+        frame_cost_.Log("mosaic");
+        assertNoGLError();
+    }
+    ResumeDone("first frame");
+}
+
+// The atlas is a single texture, it cannot be larger than the GL allows.
+// When it is, the tiles are released and the page gets
+// { type: "error", message }.
+bool PPAPIGstreamerInstance::MosaicFitsTexture()
 {
-    if(NULL != videodecodergstreamer_) {
-        VideoDecoderGstreamer_release(videodecodergstreamer_);
+    int max_size = renderer_.MaxTextureSize();
+    int width = mosaic_columns_ * mosaic_tile_size_.width();
+    int height = mosaic_rows_ * mosaic_tile_size_.height();
+    if (width <= max_size && height <= max_size)
+        return true;
+
+    std::stringstream error;
+    error << "mosaic atlas " << width << "x" << height
+          << " exceeds GL_MAX_TEXTURE_SIZE " << max_size
+          << ", use a smaller mosaic-tile or fewer streams";
+    printf("--[CPR] %s\n", error.str().c_str());
+    for (size_t i = 0; i < mosaic_.size(); i++) {
+        VideoDecoderGstreamer_queueCommand(mosaic_[i].decoder,
+                VIDEO_DECODER_CMD_RELEASE, NULL);
+    }
+    pp::VarDictionary reply;
+    reply.Set("type", "error");
+    reply.Set("message", error.str());
+    PostMessage(reply);
+    return false;
+}
+
+bool PPAPIGstreamerInstance::StartMosaic()
+{
+    mosaic_columns_ = 1;
+    while (mosaic_columns_ * mosaic_columns_ < (int)mosaic_.size())
+        mosaic_columns_++;
+    mosaic_rows_ = (mosaic_.size() + mosaic_columns_ - 1) / mosaic_columns_;
+    printf("--[CPR] StartMosaic %u streams, %dx%d tiles of %dx%d\n",
+           (unsigned)mosaic_.size(), mosaic_columns_, mosaic_rows_,
+           mosaic_tile_size_.width(), mosaic_tile_size_.height());
+
+    for (size_t i = 0; i < mosaic_.size(); i++) {
+        MosaicTile &tile = mosaic_[i];
+        tile.decoder = VideoDecoderGstreamer_create(false /* hole */);
+        VideoDecoderGstreamer_setFrameSize(tile.decoder,
+                mosaic_tile_size_.width(), mosaic_tile_size_.height());
+        VideoDecoderGstreamer_setDropPolicy(tile.decoder, tile.drop_policy,
+                kMosaicMaxQueued);
+        VideoDecoderGstreamer_setMemoryBudget(tile.decoder,
+                memory_budget_ / mosaic_.size());
+        VideoDecoderGstreamer_setParkToReady(tile.decoder, park_to_ready_);
+        if (abr_) {
+            VideoDecoderGstreamer_setAbr(tile.decoder,
+                    &PPAPIGstreamerInstance::AbrSwitch, this);
+            VideoDecoderGstreamer_setAbrCeiling(tile.decoder,
+                    mosaic_tile_size_.width(), mosaic_tile_size_.height(),
+                    abr_max_bitrate_ / mosaic_.size());
+        }
+        VideoDecoderGstreamer_setCommandCallback(tile.decoder,
+                &PPAPIGstreamerInstance::CommandDone, this);
+        VideoDecoderGstreamer_queueCommand(tile.decoder,
+                VIDEO_DECODER_CMD_INITIALIZE, tile.src.c_str());
+        VideoDecoderGstreamer_queueCommand(tile.decoder,
+                VIDEO_DECODER_CMD_PLAY, NULL);
     }
+    return true;
+}
 
+// The state changes run on the decoder worker thread, completion comes
+// back as "done:<command>:<result>" messages.
+bool PPAPIGstreamerInstance::StartPlay()
+{
     if("" != src_) {
-        videodecodergstreamer_ = VideoDecoderGstreamer_create(true /* hole */);
-        if (PP_OK != VideoDecoderGstreamer_initialize(videodecodergstreamer_, src_.c_str()) )
-            return false;
-        VideoDecoderGstreamer_play(videodecodergstreamer_);
+        if(NULL == videodecodergstreamer_) {
+            videodecodergstreamer_ = VideoDecoderGstreamer_create(use_hole_);
+            VideoDecoderGstreamer_setFrameSize(videodecodergstreamer_,
+                    kFrameWidth, kFrameHeight);
+            VideoDecoderGstreamer_setSubtitles(videodecodergstreamer_,
+                    subtitles_);
+            VideoDecoderGstreamer_setParkToReady(videodecodergstreamer_,
+                    park_to_ready_);
+            VideoDecoderGstreamer_setMemoryBudget(videodecodergstreamer_,
+                    memory_budget_);
+            if (!timeshift_path_.empty())
+                VideoDecoderGstreamer_setTimeshift(videodecodergstreamer_,
+                        timeshift_path_.c_str(), timeshift_size_);
+            if (!capture_path_.empty())
+                VideoDecoderGstreamer_setCapture(videodecodergstreamer_,
+                        capture_path_.c_str(), capture_payload_);
+            if (abr_) {
+                VideoDecoderGstreamer_setAbr(videodecodergstreamer_,
+                        &PPAPIGstreamerInstance::AbrSwitch, this);
+                UpdateAbrCeiling();
+            }
+            if (ppapi_audio_)
+                StartAudio();
+            VideoDecoderGstreamer_setCommandCallback(videodecodergstreamer_,
+                    &PPAPIGstreamerInstance::CommandDone, this);
+        } else {
+            VideoDecoderGstreamer_queueCommand(videodecodergstreamer_,
+                    VIDEO_DECODER_CMD_RELEASE, NULL);
+        }
+        VideoDecoderGstreamer_queueCommand(videodecodergstreamer_,
+                VIDEO_DECODER_CMD_INITIALIZE, src_.c_str());
+        VideoDecoderGstreamer_queueCommand(videodecodergstreamer_,
+                VIDEO_DECODER_CMD_PLAY, NULL);
 
         if( windowrect.width() != 0 && windowrect.height() != 0 ) {
             VideoDecoderGstreamer_setWindow(videodecodergstreamer_,
@@ -389,53 +777,512 @@ bool PPAPIGstreamerInstance::StartPlay()
                             windowrect.width(), windowrect.height());
         }
         if (!VideoDecoderGstreamer_useHole(videodecodergstreamer_)) {
-            PaintPicture(0);
+            StartRenderLoop();
         }
         return true;
     }
     return false;
 }
 
+// The device runs for the whole life of the decoder, playing silence while
+// the ring is empty (stopped, paused, parked).
+void PPAPIGstreamerInstance::StartAudio()
+{
+    PP_AudioSampleRate rate = pp::AudioConfig::RecommendSampleRate(this);
+    if (rate == PP_AUDIOSAMPLERATE_NONE)
+        rate = PP_AUDIOSAMPLERATE_48000;
+    uint32_t frames = pp::AudioConfig::RecommendSampleFrameCount(
+            this, rate, kAudioSampleFrames);
+
+    // PPB_Audio plays interleaved stereo 16-bit samples.
+    if (!VideoDecoderGstreamer_setAudioOutput(videodecodergstreamer_, rate, 2,
+                                              audio_ring_ms_)) {
+        printf("--[CPR] PPAPI audio output: no ring of %d ms\n",
+               audio_ring_ms_);
+        return;
+    }
+    audio_ = pp::Audio(this, pp::AudioConfig(this, rate, frames),
+                       &PPAPIGstreamerInstance::AudioCallback, this);
+    if (audio_.is_null() || !audio_.StartPlayback()) {
+        printf("--[CPR] PPAPI audio output unavailable\n");
+        return;
+    }
+    printf("--[CPR] PPAPI audio output %d Hz, %u frames per callback, "
+           "ring %d ms\n", rate, frames, audio_ring_ms_);
+}
+
+void PPAPIGstreamerInstance::AudioCallback(void* samples, uint32_t size,
+                                           PP_TimeDelta latency,
+                                           void* user_data)
+{
+    PPAPIGstreamerInstance* instance =
+            static_cast<PPAPIGstreamerInstance*>(user_data);
+    VideoDecoderGstreamer_readAudio(instance->videodecodergstreamer_,
+                                    samples, size,
+                                    static_cast<int64_t>(latency * 1e6));
+}
+
+void PPAPIGstreamerInstance::CommandDone(void* user_data,
+        VideoDecoderCommand command, int32_t result)
+{
+    PPAPIGstreamerInstance* instance =
+        static_cast<PPAPIGstreamerInstance*>(user_data);
+    pp::CompletionCallback cb = instance->callback_factory_.NewCallback(
+            &PPAPIGstreamerInstance::PostCommandDone, command);
+    instance->module_->core()->CallOnMainThread(0, cb, result);
+}
+
+void PPAPIGstreamerInstance::PostCommandDone(int32_t result,
+        VideoDecoderCommand command)
+{
+    std::stringstream event;
+    event << "done:" << VideoDecoderGstreamer_commandName(command)
+          << ":" << result;
+    if (VIDEO_DECODER_CMD_UNPARK == command && use_hole_)
+        ResumeDone("unpark");
+    PostMessage(pp::Var(event.str()));
+}
+
+void PPAPIGstreamerInstance::AbrSwitch(void* user_data,
+        const VideoDecoderAbrEvent* event)
+{
+    PPAPIGstreamerInstance* instance =
+        static_cast<PPAPIGstreamerInstance*>(user_data);
+    pp::CompletionCallback cb = instance->callback_factory_.NewCallback(
+            &PPAPIGstreamerInstance::PostAbrSwitch, *event);
+    instance->module_->core()->CallOnMainThread(0, cb, 0);
+}
+
+// Reports { type: "abr", maxBitrate, maxWidth, maxHeight, bandwidth,
+// buffer, reason, variantBitrate, variantWidth, variantHeight } whenever
+// the variant caps or the variant played change, 0 meaning unlimited for
+// the caps and unknown for the variant.
+void PPAPIGstreamerInstance::PostAbrSwitch(int32_t result,
+        VideoDecoderAbrEvent event)
+{
+    pp::VarDictionary reply;
+    reply.Set("type", "abr");
+    reply.Set("maxBitrate", static_cast<double>(event.max_bitrate));
+    reply.Set("maxWidth", event.max_width);
+    reply.Set("maxHeight", event.max_height);
+    reply.Set("bandwidth", static_cast<double>(event.bandwidth));
+    reply.Set("buffer", event.buffer_percent);
+    reply.Set("reason", event.reason);
+    reply.Set("variantBitrate", static_cast<double>(event.variant_bitrate));
+    reply.Set("variantWidth", event.variant_width);
+    reply.Set("variantHeight", event.variant_height);
+    PostMessage(reply);
+}
+
+// Decoding more pixels than are displayed is wasted: the ceiling is the
+// embed size, or the frame size textures are uploaded at.
+void PPAPIGstreamerInstance::UpdateAbrCeiling()
+{
+    if (!abr_ || !videodecodergstreamer_)
+        return;
+    int width = plugin_size_.width();
+    int height = plugin_size_.height();
+    if (!use_hole_) {
+        width = std::min(width, kFrameWidth);
+        height = std::min(height, kFrameHeight);
+    }
+    VideoDecoderGstreamer_setAbrCeiling(videodecodergstreamer_, width, height,
+            abr_max_bitrate_);
+}
+
+void PPAPIGstreamerInstance::ThumbnailsReady(void* user_data)
+{
+    PPAPIGstreamerInstance* instance =
+        static_cast<PPAPIGstreamerInstance*>(user_data);
+    pp::CompletionCallback cb = instance->callback_factory_.NewCallback(
+            &PPAPIGstreamerInstance::PostThumbnails);
+    instance->module_->core()->CallOnMainThread(0, cb, 0);
+}
+
+// Replies { type: "thumbnail", uri, time, width, height, data } where data
+// is an RGBA ArrayBuffer, or is missing when extraction failed. A batch that
+// failed as a whole is answered once, with time -1 and an error.
+void PPAPIGstreamerInstance::PostThumbnails(int32_t result)
+{
+    ThumbnailResult *thumbnail;
+
+    while ((thumbnail = ThumbnailGstreamer_popResult(thumbnailer_))) {
+        pp::VarDictionary reply;
+        reply.Set("type", "thumbnail");
+        reply.Set("uri", thumbnail->uri);
+        reply.Set("time", static_cast<double>(thumbnail->time_ms));
+        reply.Set("width", thumbnail->width);
+        reply.Set("height", thumbnail->height);
+        if (thumbnail->error)
+            reply.Set("error", thumbnail->error);
+        if (thumbnail->rgba) {
+            uint32_t size = thumbnail->width * thumbnail->height * 4;
+            pp::VarArrayBuffer data(size);
+            memcpy(data.Map(), thumbnail->rgba, size);
+            data.Unmap();
+            reply.Set("data", data);
+        }
+        PostMessage(reply);
+        ThumbnailGstreamer_freeResult(thumbnail);
+    }
+}
+
+// Replies { type: "memory", rss, queued, queuedFrames, textures, pipeline,
+// budget, budgetDrops } summed over the decoders of this instance, so that
+// a page can drive create/play/stop/release cycles and check RSS stays flat.
+void PPAPIGstreamerInstance::PostMemoryStats()
+{
+    std::vector<void*> decoders = Decoders();
+    VideoDecoderMemoryStats total;
+
+    memset(&total, 0, sizeof(total));
+    for (size_t i = 0; i < decoders.size(); i++) {
+        VideoDecoderMemoryStats stats;
+        VideoDecoderGstreamer_getMemoryStats(decoders[i], &stats);
+        total.queued_bytes += stats.queued_bytes;
+        total.queued_frames += stats.queued_frames;
+        total.texture_bytes += stats.texture_bytes;
+        total.pipeline_bytes += stats.pipeline_bytes;
+        total.budget_bytes += stats.budget_bytes;
+        total.budget_drops += stats.budget_drops;
+    }
+
+    pp::VarDictionary reply;
+    reply.Set("type", "memory");
+    reply.Set("rss", static_cast<double>(ProcessRss()));
+    reply.Set("queued", static_cast<double>(total.queued_bytes));
+    reply.Set("queuedFrames", static_cast<int32_t>(total.queued_frames));
+    reply.Set("textures", static_cast<double>(total.texture_bytes));
+    reply.Set("pipeline", static_cast<double>(total.pipeline_bytes));
+    reply.Set("budget", static_cast<double>(total.budget_bytes));
+    reply.Set("budgetDrops", static_cast<int32_t>(total.budget_drops));
+    PostMessage(reply);
+}
+
 bool PPAPIGstreamerInstance::Init(uint32_t argc, const char* argn[], const char* argv[])
 {
+    MainThreadTimer timer("Init");
+    std::string mosaic_drop;
+
     for (uint32_t i = 0; i < argc; i++) {
         printf("-----%s---%s\n",argn[i],argv[i]);
         if (strcmp("src", argn[i]) == 0) {
             src_ = argv[i];
+        } else if (strcmp("mosaic", argn[i]) == 0) {
+            // '|' separated list of URIs, one tile each.
+            std::stringstream uris(argv[i]);
+            std::string uri;
+            while (std::getline(uris, uri, '|')) {
+                if (uri.empty())
+                    continue;
+                mosaic_.push_back(MosaicTile());
+                mosaic_.back().src = uri;
+            }
+        } else if (strcmp("mosaic-tile", argn[i]) == 0) {
+            int width, height;
+            if (sscanf(argv[i], "%dx%d", &width, &height) == 2 &&
+                width >= 4 && height > 0) {
+                // Keep RGB rows 4-byte aligned as GStreamer and GL expect.
+                if (width & 3) {
+                    printf("--[CPR] mosaic-tile %dx%d rounded down to %dx%d\n",
+                           width, height, width & ~3, height);
+                }
+                mosaic_tile_size_.SetSize(width & ~3, height);
+            }
+        } else if (strcmp("mosaic-drop", argn[i]) == 0) {
+            mosaic_drop = argv[i];
+        } else if (strcmp("hole", argn[i]) == 0) {
+            // "false" renders the video through textures instead of a KMS
+            // plane behind a colorkey hole.
+            use_hole_ = strcmp("false", argv[i]) != 0;
+        } else if (strcmp("subtitles", argn[i]) == 0) {
+            // Texture mode only: "gpu" or "pipeline" (CPU blending).
+            if (strcmp("gpu", argv[i]) == 0)
+                subtitles_ = VIDEO_DECODER_SUBTITLES_GPU;
+            else if (strcmp("pipeline", argv[i]) == 0)
+                subtitles_ = VIDEO_DECODER_SUBTITLES_PIPELINE;
+        } else if (strcmp("texture-pool", argn[i]) == 0) {
+            // Texture mode only: 2 or 3 let the upload of a frame overlap
+            // the draw of the previous one, at the cost of texture memory.
+            texture_pool_ = atoi(argv[i]);
+            if (texture_pool_ < 1)
+                texture_pool_ = 1;
+            if (texture_pool_ > TextureRenderer::kMaxPoolSize)
+                texture_pool_ = TextureRenderer::kMaxPoolSize;
+        } else if (strcmp("park-delay-ms", argn[i]) == 0) {
+            park_delay_ms_ = atoi(argv[i]);
+        } else if (strcmp("park", argn[i]) == 0) {
+            // "ready" releases decoders and buffers, "paused" (default)
+            // resumes faster.
+            park_to_ready_ = strcmp("ready", argv[i]) == 0;
+        } else if (strcmp("hidden-video", argn[i]) == 0) {
+            // "skip" stops decoding video while hidden, audio goes on.
+            hidden_skip_decode_ = strcmp("skip", argv[i]) == 0;
+        } else if (strcmp("memory-budget-kb", argn[i]) == 0) {
+            unsigned long kb = strtoul(argv[i], NULL, 10);
+            if (kb > UINT_MAX / 1024) {
+                kb = UINT_MAX / 1024;
+                printf("--[CPR] memory-budget-kb clamped to %lu\n", kb);
+            }
+            memory_budget_ = kb * 1024;
+        } else if (strcmp("timeshift", argn[i]) == 0) {
+            // Name of the file the live stream is recorded into, in the
+            // plugin cache directory, single stream only.
+            timeshift_path_ = argv[i];
+        } else if (strcmp("timeshift-size-mb", argn[i]) == 0) {
+            uint64_t size = strtoull(argv[i], NULL, 10);
+            if (size)
+                timeshift_size_ = size << 20;
+        } else if (strcmp("capture", argn[i]) == 0) {
+            // Records the decoded frames into the plugin cache directory,
+            // replayed with src="replay://<name>".
+            capture_path_ = argv[i];
+        } else if (strcmp("capture-payload", argn[i]) == 0) {
+            // "false" only keeps caps and timestamps.
+            capture_payload_ = strcmp("false", argv[i]) != 0;
+        } else if (strcmp("abr", argn[i]) == 0) {
+            // "off" leaves the variant choice to the demuxer.
+            abr_ = strcmp("off", argv[i]) != 0;
+        } else if (strcmp("audio", argn[i]) == 0) {
+            // "ppapi" plays audio through the browser instead of the
+            // native audio sink, single stream only.
+            ppapi_audio_ = strcmp("ppapi", argv[i]) == 0;
+        } else if (strcmp("audio-ring-ms", argn[i]) == 0) {
+            int32_t ring_ms = atoi(argv[i]);
+            if (ring_ms > 0)
+                audio_ring_ms_ = std::min(ring_ms, kAudioMaxRingMs);
+        } else if (strcmp("abr-max-kbps", argn[i]) == 0) {
+            abr_max_bitrate_ = strtoull(argv[i], NULL, 10) * 1000;
+        } else if (strcmp("thumbnail-size", argn[i]) == 0) {
+            int width, height;
+            if (sscanf(argv[i], "%dx%d", &width, &height) == 2 &&
+                width > 0 && height > 0)
+                thumbnail_size_.SetSize(width, height);
         }
     }
+
+    if (!mosaic_.empty()) {
+        // ',' separated per-tile policy: "latest", "queue" or "none".
+        std::stringstream policies(mosaic_drop);
+        std::string policy;
+        for (size_t i = 0; i < mosaic_.size() &&
+                std::getline(policies, policy, ','); i++) {
+            if (policy == "queue")
+                mosaic_[i].drop_policy = VIDEO_DECODER_DROP_OLDEST;
+            else if (policy == "none")
+                mosaic_[i].drop_policy = VIDEO_DECODER_DROP_NONE;
+        }
+        return StartMosaic();
+    }
     return StartPlay();
 }
+std::vector<void*> PPAPIGstreamerInstance::Decoders()
+{
+    std::vector<void*> decoders;
+    if (videodecodergstreamer_)
+        decoders.push_back(videodecodergstreamer_);
+    for (size_t i = 0; i < mosaic_.size(); i++)
+        decoders.push_back(mosaic_[i].decoder);
+    return decoders;
+}
+
+void PPAPIGstreamerInstance::StartRenderLoop()
+{
+    if (paint_pending_ || !context_)
+        return;
+    if (!mosaic_.empty())
+        MosaicPaint(0);
+    else if (!use_hole_)
+        PaintPicture(0);
+}
+
+// Logs the resume latency once the player shows video again.
+void PPAPIGstreamerInstance::ResumeDone(const char* what)
+{
+    if (!resume_start_)
+        return;
+    double latency = module_->core()->GetTimeTicks() - resume_start_;
+    printf("--[STATS] resume: %s after %.1f ms%s\n", what, latency * 1000,
+           latency > kResumeTargetSec ? " (over target)" : "");
+    resume_start_ = 0;
+}
+
+void PPAPIGstreamerInstance::SetVisibility(Visibility visibility)
+{
+    static const char* kNames[] = { "visible", "hidden", "parked" };
+    std::vector<void*> decoders = Decoders();
+    Visibility old = visibility_;
+
+    if (visibility == old)
+        return;
+
+    // CPU and memory used in the state being left.
+    PP_TimeTicks now = module_->core()->GetTimeTicks();
+    double cpu = ProcessCpuTime();
+    if (visibility_since_) {
+        double elapsed = now - visibility_since_;
+        printf("--[STATS] %s for %.1f s: cpu %.1f%% rss %u kB\n",
+               kNames[old], elapsed,
+               elapsed > 0 ? 100.0 * (cpu - visibility_cpu_since_) / elapsed : 0,
+               ProcessRss() / 1024);
+    }
+    visibility_since_ = now;
+    visibility_cpu_since_ = cpu;
+    visibility_ = visibility;
+    visibility_generation_++;
+
+    for (size_t i = 0; i < decoders.size(); i++) {
+        if (kParked == visibility)
+            VideoDecoderGstreamer_queueCommand(decoders[i],
+                    VIDEO_DECODER_CMD_PARK, NULL);
+        else if (kParked == old)
+            VideoDecoderGstreamer_queueCommand(decoders[i],
+                    VIDEO_DECODER_CMD_UNPARK, NULL);
+        VideoDecoderGstreamer_setVideoEnabled(decoders[i],
+                kVisible == visibility);
+        // playbin flags are only changed from the worker
+        if (hidden_skip_decode_ && (kVisible == visibility || kVisible == old))
+            VideoDecoderGstreamer_queueCommand(decoders[i],
+                    kVisible == visibility ? VIDEO_DECODER_CMD_DECODE_VIDEO
+                                           : VIDEO_DECODER_CMD_SKIP_VIDEO,
+                    NULL);
+    }
+
+    if (kHidden == visibility) {
+        pp::CompletionCallback cb = callback_factory_.NewCallback(
+                &PPAPIGstreamerInstance::ParkIfHidden);
+        module_->core()->CallOnMainThread(park_delay_ms_, cb,
+                                          visibility_generation_);
+    } else if (kVisible == visibility) {
+        resume_start_ = now;
+        StartRenderLoop();
+        DamageColorKey();
+    }
+}
+
+void PPAPIGstreamerInstance::ParkIfHidden(int32_t generation)
+{
+    // A newer visibility change makes this timer stale.
+    if (generation == visibility_generation_ && kHidden == visibility_)
+        SetVisibility(kParked);
+}
+
+void PPAPIGstreamerInstance::DidChangeView(const pp::View& view)
+{
+    if (!view.IsVisible() || view.GetRect().IsEmpty()) {
+        MainThreadTimer timer("DidChangeView");
+        if (kVisible == visibility_)
+            SetVisibility(kHidden);
+        return;
+    }
+    DidChangeView(view.GetRect(), view.GetClipRect());
+    SetVisibility(kVisible);
+}
+
 void PPAPIGstreamerInstance::DidChangeView(
     const pp::Rect& position, const pp::Rect& clip_ignored)
 {
+    MainThreadTimer timer("DidChangeView");
     if (0 == position.width() || 0 == position.height())
         return;
     plugin_size_ = position.size();
     printf("--[CPR] -----PPAPIGstreamerInstance::DidChangeView %d %d %d %d\n",
             position.x(), position.y(), position.width(),position.height());
     // set player video rect
-    VideoDecoderGstreamer_setWindow(videodecodergstreamer_,
-                    position.x(), position.y(),
-                    position.width(), position.height());
+    if (videodecodergstreamer_)
+        VideoDecoderGstreamer_setWindow(videodecodergstreamer_,
+                        position.x(), position.y(),
+                        position.width(), position.height());
+    UpdateAbrCeiling();
     windowrect = position;
     // Initialize graphics.
     InitGL(0);
 }
 void PPAPIGstreamerInstance::HandleMessage(const pp::Var& var_message)
 {
+    MainThreadTimer timer("HandleMessage");
     if (!var_message.is_string())
       return;
     std::string message = var_message.AsString();
     printf("--[CPR] ----HandleMessage %s \n",message.c_str());
-    if("playPause()" == message) {
-        if(!VideoDecoderGstreamer_isPlaying(videodecodergstreamer_)) {
-            StartPlay();
+
+    if ("memoryStats()" == message) {
+        PostMemoryStats();
+        return;
+    }
+
+    long long thumbnail_arg;
+    if (sscanf(message.c_str(), "thumbnail(%lld)", &thumbnail_arg) == 1 ||
+        sscanf(message.c_str(), "thumbnails(%lld)", &thumbnail_arg) == 1) {
+        std::string uri = mosaic_.empty() ? src_ : mosaic_[0].src;
+        if (!thumbnailer_) {
+            thumbnailer_ = ThumbnailGstreamer_create(thumbnail_size_.width(),
+                    thumbnail_size_.height(),
+                    &PPAPIGstreamerInstance::ThumbnailsReady, this);
         }
-        VideoDecoderGstreamer_pause(videodecodergstreamer_);
+        int32_t queued = PP_ERROR_BADARGUMENT;
+        if (0 != message.compare(0, strlen("thumbnails("), "thumbnails("))
+            queued = ThumbnailGstreamer_request(thumbnailer_, uri.c_str(),
+                    thumbnail_arg);
+        else if (thumbnail_arg <= INT_MAX)
+            queued = ThumbnailGstreamer_requestBatch(thumbnailer_, uri.c_str(),
+                    static_cast<int>(thumbnail_arg));
+        if (queued != PP_OK_COMPLETIONPENDING) {
+            pp::VarDictionary reply;
+            reply.Set("type", "thumbnail");
+            reply.Set("uri", uri);
+            reply.Set("request", message);
+            reply.Set("error", "bad argument");
+            PostMessage(reply);
+        }
+        return;
+    }
+    if (!mosaic_.empty()) {
+        for (size_t i = 0; i < mosaic_.size(); i++) {
+            if ("playPause()" == message && mosaic_stopped_) {
+                // Released tiles start over from their source.
+                VideoDecoderGstreamer_queueCommand(mosaic_[i].decoder,
+                        VIDEO_DECODER_CMD_INITIALIZE, mosaic_[i].src.c_str());
+                VideoDecoderGstreamer_queueCommand(mosaic_[i].decoder,
+                        VIDEO_DECODER_CMD_PLAY, NULL);
+            } else if ("playPause()" == message) {
+                VideoDecoderGstreamer_queueCommand(mosaic_[i].decoder,
+                        VIDEO_DECODER_CMD_PLAY_PAUSE, NULL);
+            } else if ("stop()" == message) {
+                VideoDecoderGstreamer_queueCommand(mosaic_[i].decoder,
+                        VIDEO_DECODER_CMD_RELEASE, NULL);
+            }
+        }
+        if ("playPause()" == message)
+            mosaic_stopped_ = false;
+        else if ("stop()" == message)
+            mosaic_stopped_ = true;
+        return;
+    }
+    if (!videodecodergstreamer_)
+        return;
+    if("playPause()" == message) {
+        VideoDecoderGstreamer_queueCommand(videodecodergstreamer_,
+                VIDEO_DECODER_CMD_PLAY_PAUSE, NULL);
     }
     else if ("stop()" == message) {
-        VideoDecoderGstreamer_release(videodecodergstreamer_);
+        VideoDecoderGstreamer_queueCommand(videodecodergstreamer_,
+                VIDEO_DECODER_CMD_RELEASE, NULL);
+    }
+    else if ("live()" == message) {
+        VideoDecoderGstreamer_queueTimeshift(videodecodergstreamer_,
+                VIDEO_DECODER_CMD_TIMESHIFT, 0, 0, NULL);
+    }
+    else {
+        long long from_ms, to_ms;
+        char path[256];
+        if (sscanf(message.c_str(), "timeshift(%lld)", &from_ms) == 1)
+            VideoDecoderGstreamer_queueTimeshift(videodecodergstreamer_,
+                    VIDEO_DECODER_CMD_TIMESHIFT, from_ms, 0, NULL);
+        else if (sscanf(message.c_str(), "timeshiftExport(%lld,%lld,%255[^)])",
+                        &from_ms, &to_ms, path) == 3)
+            VideoDecoderGstreamer_queueTimeshift(videodecodergstreamer_,
+                    VIDEO_DECODER_CMD_TIMESHIFT_EXPORT, from_ms, to_ms, path);
     }
 }
 
@@ -458,6 +1305,7 @@ void PPAPIGstreamerInstance::InitGL(int32_t result)
 
     if (context_) {
         context_->ResizeBuffers(plugin_size_.width(), plugin_size_.height());
+        DamageColorKey();
         return;
     }
     int32_t context_attributes[] = {
@@ -475,11 +1323,11 @@ void PPAPIGstreamerInstance::InitGL(int32_t result)
     };
     context_ = new pp::Graphics3D(this, context_attributes);
     assert(!context_->is_null());
+    renderer_.SetContext(context_->pp_resource());
 #if 1
     // Set viewport window size and clear color bit.
     // Clear color bit.
-    gles2_if_->ClearColor(context_->pp_resource(), 0, 1, 0, 1);
-    gles2_if_->Clear(context_->pp_resource(), GL_COLOR_BUFFER_BIT);
+    renderer_.Clear(0, 1, 0, 1);
 
     gles2_if_->Viewport(context_->pp_resource(), 0, 0, plugin_size_.width(), plugin_size_.height());
 
@@ -487,36 +1335,77 @@ void PPAPIGstreamerInstance::InitGL(int32_t result)
     assert(BindGraphics(*context_));
 
     assertNoGLError();
+    if (!mosaic_.empty()) {
+        if (MosaicFitsTexture())
+            StartRenderLoop();
+        return;
+    }
 printf("--[CPR] InitGL paint %s\n", (VideoDecoderGstreamer_useHole(videodecodergstreamer_)?"true":"false"));
     if (!VideoDecoderGstreamer_useHole(videodecodergstreamer_)) {
 //if NO_HOLE
-        PaintPicture(0);
+        StartRenderLoop();
 //#endif //NO_HOLE
     } else {
-        FlickerAndPaint(0);
+        DamageColorKey();
+        if (!colorkey_stats_started_) {
+            colorkey_stats_started_ = true;
+            ColorKeyStats(0);
+        }
     }
 }
 
-void PPAPIGstreamerInstance::FlickerAndPaint(int32_t result)
+void PPAPIGstreamerInstance::DamageColorKey()
+{
+    if (!videodecodergstreamer_ ||
+        !VideoDecoderGstreamer_useHole(videodecodergstreamer_))
+        return;
+    colorkey_damaged_ = true;
+    // Painted when the player becomes visible again.
+    if (visibility_ != kVisible)
+        return;
+    // A swap in flight repaints on completion.
+    if (!colorkey_swap_pending_)
+        PaintColorKey(0);
+}
+
+void PPAPIGstreamerInstance::PaintColorKey(int32_t result)
 {
-    if (result != 0 || !context_)
+    if (result != 0 || !context_ || !colorkey_damaged_)
         return;
+    colorkey_damaged_ = false;
+
     //colorkey is red
-    if (VideoDecoderGstreamer_useHole(videodecodergstreamer_)) {
-        float r = 1;
-        float g = 0;
-        float b = 0;
-        float a = 1;
-        gles2_if_->ClearColor(context_->pp_resource(), r, g, b, a);
-        gles2_if_->Clear(context_->pp_resource(), GL_COLOR_BUFFER_BIT);
-        assertNoGLError();
-    }
+    float r = 1;
+    float g = 0;
+    float b = 0;
+    float a = 1;
+    renderer_.Clear(r, g, b, a);
+    assertNoGLError();
 
     pp::CompletionCallback cb = callback_factory_.NewCallback(
-        &PPAPIGstreamerInstance::FlickerAndPaint);
+        &PPAPIGstreamerInstance::ColorKeySwapped);
 
+    colorkey_swap_pending_ = true;
     context_->SwapBuffers(cb);
     assertNoGLError();
+    colorkey_paints_.Tick();
+}
+
+void PPAPIGstreamerInstance::ColorKeySwapped(int32_t result)
+{
+    colorkey_swap_pending_ = false;
+    PaintColorKey(result);
+}
+
+// Nothing paints while the video plays behind the hole, the CPU and the
+// wakeups of that idle state are logged from this timer.
+void PPAPIGstreamerInstance::ColorKeyStats(int32_t result)
+{
+    colorkey_paints_.Poll();
+    pp::CompletionCallback cb = callback_factory_.NewCallback(
+        &PPAPIGstreamerInstance::ColorKeyStats);
+    module_->core()->CallOnMainThread(
+        static_cast<int32_t>(kStatsIntervalSec * 1000), cb, 0);
 }
 
 }  // anonymous namespace
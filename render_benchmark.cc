@@ -0,0 +1,177 @@
+/*
+ * render_benchmark.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "ppapi/lib/gl/include/GLES2/gl2.h"
+
+#include "gl_backend_egl.h"
+#include "texture_renderer.h"
+
+// Measures the texture render path of the plugin (frame upload, then draw
+// to a viewport of the frame size) on an offscreen EGL context, so that it
+// runs on any Linux machine, llvmpipe included:
+//
+//   ppapi_gstreamer_render_benchmark [--sizes=320x240,1280x720]
+//       [--formats=rgb,rgba] [--pools=1,2,3] [--frames=300]
+//
+// upload and draw are the CPU time spent issuing them per frame, frame is
+// the wall time per frame including the wait for the last one to render,
+// cmds the GL commands the renderer issued per frame.
+
+namespace {
+
+struct Size {
+  int width;
+  int height;
+};
+
+double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+std::vector<std::string> Split(const char* list) {
+  std::vector<std::string> items;
+  std::string item;
+  for (const char* p = list; ; p++) {
+    if (*p == ',' || *p == '\0') {
+      if (!item.empty())
+        items.push_back(item);
+      item.clear();
+      if (*p == '\0')
+        break;
+    } else {
+      item += *p;
+    }
+  }
+  return items;
+}
+
+// Frames differ from one another so that no upload can be skipped.
+void FillFrame(std::vector<unsigned char>* frame, int index) {
+  for (size_t i = 0; i < frame->size(); i++)
+    (*frame)[i] = static_cast<unsigned char>(i * 7 + index * 31);
+}
+
+bool RunCase(GLBackendEgl* backend, Size size, GLenum format, int pool,
+             int frames) {
+  if (!backend->Resize(size.width, size.height)) {
+    fprintf(stderr, "cannot render to %dx%d\n", size.width, size.height);
+    return false;
+  }
+  int bytes_per_pixel = format == GL_RGBA ? 4 : 3;
+  std::vector<unsigned char> data[2];
+  for (int i = 0; i < 2; i++) {
+    data[i].resize(size.width * size.height * bytes_per_pixel);
+    FillFrame(&data[i], i);
+  }
+
+  TextureRenderer renderer(backend->gl(), backend->context());
+  renderer.SetFrameFormat(size.width, size.height, format, pool, GL_NEAREST);
+  // The first frames allocate the textures and compile the programs.
+  for (int i = 0; i < pool; i++) {
+    renderer.UploadFrame(&data[i % 2][0]);
+    renderer.Draw(size.width, size.height);
+  }
+  backend->Finish();
+  renderer.TakeCommands();
+
+  double upload = 0, draw = 0;
+  double start = Now();
+  for (int i = 0; i < frames; i++) {
+    double t0 = Now();
+    renderer.UploadFrame(&data[i % 2][0]);
+    double t1 = Now();
+    renderer.Draw(size.width, size.height);
+    backend->gl()->Flush(backend->context());
+    upload += t1 - t0;
+    draw += Now() - t1;
+  }
+  backend->Finish();
+  double elapsed = Now() - start;
+
+  printf("%-4s %5dx%-5d pool %d  upload %7.3f ms  draw %7.3f ms  "
+         "frame %7.3f ms  %7.1f fps  %8.1f MB/s  %4.1f cmds%s\n",
+         format == GL_RGBA ? "rgba" : "rgb", size.width, size.height, pool,
+         upload * 1000 / frames, draw * 1000 / frames,
+         elapsed * 1000 / frames, frames / elapsed,
+         data[0].size() * frames / elapsed / (1024 * 1024),
+         static_cast<double>(renderer.TakeCommands()) / frames,
+         renderer.NoGLError() ? "" : "  GL error");
+  renderer.Release();
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* sizes = "320x240,640x480,1280x720,1920x1080";
+  const char* formats = "rgb,rgba";
+  const char* pools = "1,2,3";
+  int frames = 300;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--sizes=", 8) == 0) {
+      sizes = argv[i] + 8;
+    } else if (strncmp(argv[i], "--formats=", 10) == 0) {
+      formats = argv[i] + 10;
+    } else if (strncmp(argv[i], "--pools=", 8) == 0) {
+      pools = argv[i] + 8;
+    } else if (strncmp(argv[i], "--frames=", 9) == 0) {
+      frames = atoi(argv[i] + 9);
+    } else {
+      fprintf(stderr, "usage: %s [--sizes=WxH,...] [--formats=rgb,rgba] "
+              "[--pools=1..4,...] [--frames=N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (frames < 1)
+    frames = 1;
+
+  std::vector<std::string> pool_list = Split(pools);
+  std::vector<int> pool_sizes;
+  for (size_t p = 0; p < pool_list.size(); p++) {
+    // SetFrameFormat would clamp it and the case would be mislabelled
+    int pool = atoi(pool_list[p].c_str());
+    if (pool < 1 || pool > TextureRenderer::kMaxPoolSize) {
+      fprintf(stderr, "bad pool %s\n", pool_list[p].c_str());
+      return 1;
+    }
+    pool_sizes.push_back(pool);
+  }
+
+  GLBackendEgl backend;
+  if (!backend.Init())
+    return 1;
+  printf("renderer: %s, %d frames per case\n", backend.renderer(), frames);
+
+  std::vector<std::string> size_list = Split(sizes);
+  std::vector<std::string> format_list = Split(formats);
+  for (size_t s = 0; s < size_list.size(); s++) {
+    Size size;
+    if (sscanf(size_list[s].c_str(), "%dx%d", &size.width, &size.height) != 2 ||
+        size.width <= 0 || size.height <= 0) {
+      fprintf(stderr, "bad size %s\n", size_list[s].c_str());
+      return 1;
+    }
+    for (size_t f = 0; f < format_list.size(); f++) {
+      GLenum format = format_list[f] == "rgba" ? GL_RGBA : GL_RGB;
+      for (size_t p = 0; p < pool_sizes.size(); p++) {
+        if (!RunCase(&backend, size, format, pool_sizes[p], frames))
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
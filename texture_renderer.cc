@@ -0,0 +1,381 @@
+/*
+ * texture_renderer.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ppapi/lib/gl/include/GLES2/gl2.h"
+
+#include "texture_renderer.h"
+
+// Issues a GL command on the renderer's context, counted for the stats.
+#define GL(function, ...) \
+  (commands_++, gl_->function(context_, ##__VA_ARGS__))
+
+namespace {
+
+// Attribute locations, bound before linking so that the vertex arrays
+// are set up once for both programs.
+const GLuint kPositionAttrib = 0;
+const GLuint kTexCoordAttrib = 1;
+
+// Cached state that does not match anything GL could have set.
+const GLuint kUnknown = ~0u;
+
+static const char kVertexShader[] =
+    "varying vec2 v_texCoord;            \n"
+    "attribute vec4 a_position;          \n"
+    "attribute vec2 a_texCoord;          \n"
+    "uniform vec2 v_scale;               \n"
+    "void main()                         \n"
+    "{                                   \n"
+    "    v_texCoord = v_scale * a_texCoord; \n"
+    "    gl_Position = a_position;       \n"
+    "}";
+
+static const char kFragmentShader2D[] =
+    "precision mediump float;            \n"
+    "varying vec2 v_texCoord;            \n"
+    "uniform sampler2D s_texture;        \n"
+    "void main()                         \n"
+    "{"
+    "    gl_FragColor = texture2D(s_texture, v_texCoord); \n"
+    "}";
+
+static const char kFragmentShaderOverlay[] =
+    "precision mediump float;            \n"
+    "varying vec2 v_texCoord;            \n"
+    "uniform sampler2D s_texture;        \n"
+    "uniform sampler2D s_overlay;        \n"
+    "uniform float v_overlay_alpha;      \n"
+    "void main()                         \n"
+    "{"
+    "    vec4 video = texture2D(s_texture, v_texCoord); \n"
+    "    vec4 overlay = texture2D(s_overlay, v_texCoord); \n"
+    "    gl_FragColor = vec4(mix(video.rgb, overlay.rgb, \n"
+    "                            overlay.a * v_overlay_alpha), 1.0); \n"
+    "}";
+
+// Full viewport triangle strip: positions, then texture coordinates with
+// the first row of the frame at the top.
+static const float kVertices[] = {
+  -1, -1,  1, -1,  -1, 1,  1, 1,
+   0,  1,  1,  1,   0, 0,  1, 0,
+};
+
+}  // namespace
+
+TextureRenderer::TextureRenderer(const PPB_OpenGLES2* gl, PP_Resource context)
+    : gl_(gl),
+      context_(context),
+      width_(0),
+      height_(0),
+      format_(GL_RGB),
+      filter_(GL_NEAREST),
+      pool_size_(1),
+      current_(0),
+      overlay_texture_(0),
+      vertex_buffer_(0),
+      commands_(0) {
+  memset(textures_, 0, sizeof(textures_));
+  ResetState();
+}
+
+TextureRenderer::~TextureRenderer() {
+}
+
+void TextureRenderer::SetContext(PP_Resource context) {
+  context_ = context;
+  ForgetObjects();
+}
+
+void TextureRenderer::ForgetObjects() {
+  memset(textures_, 0, sizeof(textures_));
+  current_ = 0;
+  overlay_texture_ = 0;
+  vertex_buffer_ = 0;
+  program_2d_ = Program();
+  program_overlay_ = Program();
+  ResetState();
+}
+
+void TextureRenderer::ResetState() {
+  state_.program = kUnknown;
+  state_.active_unit = kUnknown;
+  for (int i = 0; i < kTextureUnits; i++)
+    state_.textures[i] = kUnknown;
+  state_.viewport_width = -1;
+  state_.viewport_height = -1;
+  state_.unpack_alignment = 0;
+}
+
+void TextureRenderer::Release() {
+  DeleteTextures();
+  if (context_) {
+    if (vertex_buffer_)
+      GL(DeleteBuffers, 1, &vertex_buffer_);
+    if (program_2d_.program)
+      GL(DeleteProgram, program_2d_.program);
+    if (program_overlay_.program)
+      GL(DeleteProgram, program_overlay_.program);
+  }
+  ForgetObjects();
+}
+
+unsigned TextureRenderer::TakeCommands() {
+  unsigned commands = commands_;
+  commands_ = 0;
+  return commands;
+}
+
+int TextureRenderer::BytesPerPixel() const {
+  return format_ == GL_RGBA ? 4 : 3;
+}
+
+void TextureRenderer::DeleteTextures() {
+  if (context_) {
+    GL(DeleteTextures, kMaxPoolSize, textures_);
+    if (overlay_texture_)
+      GL(DeleteTextures, 1, &overlay_texture_);
+  }
+  memset(textures_, 0, sizeof(textures_));
+  overlay_texture_ = 0;
+  current_ = 0;
+  // Deleted names are unbound and may be handed out again.
+  for (int i = 0; i < kTextureUnits; i++)
+    state_.textures[i] = kUnknown;
+}
+
+void TextureRenderer::SetFrameFormat(int width, int height, GLenum format,
+                                     int pool_size, GLenum filter) {
+  if (pool_size < 1)
+    pool_size = 1;
+  if (pool_size > kMaxPoolSize)
+    pool_size = kMaxPoolSize;
+  if (width == width_ && height == height_ && format == format_ &&
+      pool_size == pool_size_ && filter == filter_)
+    return;
+  DeleteTextures();
+  width_ = width;
+  height_ = height;
+  format_ = format;
+  pool_size_ = pool_size;
+  filter_ = filter;
+}
+
+void TextureRenderer::UseProgram(GLuint program) {
+  if (state_.program == program)
+    return;
+  GL(UseProgram, program);
+  state_.program = program;
+}
+
+// Binds texture to unit and leaves that unit active, for the uploads.
+void TextureRenderer::BindTexture(GLuint unit, GLuint texture) {
+  if (state_.active_unit != unit) {
+    GL(ActiveTexture, GL_TEXTURE0 + unit);
+    state_.active_unit = unit;
+  }
+  if (state_.textures[unit] == texture)
+    return;
+  GL(BindTexture, GL_TEXTURE_2D, texture);
+  state_.textures[unit] = texture;
+}
+
+void TextureRenderer::SetViewport(int width, int height) {
+  if (state_.viewport_width == width && state_.viewport_height == height)
+    return;
+  GL(Viewport, 0, 0, width, height);
+  state_.viewport_width = width;
+  state_.viewport_height = height;
+}
+
+// RGB rows are not always 4-byte aligned.
+void TextureRenderer::SetUnpackAlignment(int row_bytes) {
+  GLint alignment = row_bytes % 4 ? 1 : 4;
+  if (state_.unpack_alignment == alignment)
+    return;
+  GL(PixelStorei, GL_UNPACK_ALIGNMENT, alignment);
+  state_.unpack_alignment = alignment;
+}
+
+// The texture parameters are only set here, textures keep them.
+void TextureRenderer::AllocateTexture(GLuint unit, GLuint* texture,
+                                      GLenum format, GLenum filter,
+                                      const void* data) {
+  GL(GenTextures, 1, texture);
+  BindTexture(unit, *texture);
+  GL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  GL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  GL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  GL(TexParameteri, GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  GL(TexImage2D, GL_TEXTURE_2D, 0, format, width_, height_, 0, format,
+     GL_UNSIGNED_BYTE, data);
+}
+
+void TextureRenderer::UploadFrame(const void* data) {
+  int next = (current_ + 1) % pool_size_;
+
+  SetUnpackAlignment(width_ * BytesPerPixel());
+  if (!textures_[next]) {
+    AllocateTexture(0, &textures_[next], format_, filter_, data);
+  } else {
+    BindTexture(0, textures_[next]);
+    GL(TexSubImage2D, GL_TEXTURE_2D, 0, 0, 0, width_, height_, format_,
+       GL_UNSIGNED_BYTE, data);
+  }
+  current_ = next;
+}
+
+void TextureRenderer::UploadFrameRect(int x, int y, int width, int height,
+                                      const void* data) {
+  if (!textures_[current_]) {
+    // Parts never uploaded to are drawn too, they must not show whatever
+    // the driver left in that memory.
+    void* black = calloc(width_ * height_, BytesPerPixel());
+    SetUnpackAlignment(width_ * BytesPerPixel());
+    AllocateTexture(0, &textures_[current_], format_, filter_, black);
+    free(black);
+  } else {
+    BindTexture(0, textures_[current_]);
+  }
+  SetUnpackAlignment(width * BytesPerPixel());
+  GL(TexSubImage2D, GL_TEXTURE_2D, 0, x, y, width, height, format_,
+     GL_UNSIGNED_BYTE, data);
+}
+
+void TextureRenderer::UploadOverlay(const void* data) {
+  SetUnpackAlignment(width_ * 4);
+  if (!overlay_texture_) {
+    AllocateTexture(1, &overlay_texture_, GL_RGBA, GL_NEAREST, data);
+  } else {
+    BindTexture(1, overlay_texture_);
+    GL(TexSubImage2D, GL_TEXTURE_2D, 0, 0, 0, width_, height_, GL_RGBA,
+       GL_UNSIGNED_BYTE, data);
+  }
+}
+
+void TextureRenderer::CreateShader(GLuint program, GLenum type,
+                                   const char* source) {
+  int size = strlen(source);
+  GLuint shader = GL(CreateShader, type);
+  GL(ShaderSource, shader, 1, &source, &size);
+  GL(CompileShader, shader);
+  GL(AttachShader, program, shader);
+  GL(DeleteShader, shader);
+}
+
+// The vertex arrays are context state: set up once, used by both programs.
+void TextureRenderer::CreateVertexBufferOnce() {
+  if (vertex_buffer_)
+    return;
+  GL(GenBuffers, 1, &vertex_buffer_);
+  GL(BindBuffer, GL_ARRAY_BUFFER, vertex_buffer_);
+  GL(BufferData, GL_ARRAY_BUFFER, sizeof(kVertices), kVertices,
+     GL_STATIC_DRAW);
+  GL(EnableVertexAttribArray, kPositionAttrib);
+  GL(VertexAttribPointer, kPositionAttrib, 2, GL_FLOAT, GL_FALSE, 0, 0);
+  GL(EnableVertexAttribArray, kTexCoordAttrib);
+  GL(VertexAttribPointer,
+     kTexCoordAttrib,
+     2,
+     GL_FLOAT,
+     GL_FALSE,
+     0,
+     static_cast<const float*>(0) + 8);  // Skip position coordinates.
+}
+
+// Uniforms that never change are set here, once.
+TextureRenderer::Program TextureRenderer::CreateProgram(
+    const char* fragment_shader) {
+  Program program;
+
+  CreateVertexBufferOnce();
+  program.program = GL(CreateProgram);
+  CreateShader(program.program, GL_VERTEX_SHADER, kVertexShader);
+  CreateShader(program.program, GL_FRAGMENT_SHADER, fragment_shader);
+  GL(BindAttribLocation, program.program, kPositionAttrib, "a_position");
+  GL(BindAttribLocation, program.program, kTexCoordAttrib, "a_texCoord");
+  GL(LinkProgram, program.program);
+  UseProgram(program.program);
+  GLint texture_location =
+      GL(GetUniformLocation, program.program, "s_texture");
+  GLint scale_location = GL(GetUniformLocation, program.program, "v_scale");
+  GL(Uniform1i, texture_location, 0);
+  GL(Uniform2f, scale_location, 1.0, 1.0);
+  return program;
+}
+
+TextureRenderer::Program* TextureRenderer::Program2DOnce() {
+  if (!program_2d_.program)
+    program_2d_ = CreateProgram(kFragmentShader2D);
+  return &program_2d_;
+}
+
+TextureRenderer::Program* TextureRenderer::ProgramOverlayOnce() {
+  if (program_overlay_.program)
+    return &program_overlay_;
+  program_overlay_ = CreateProgram(kFragmentShaderOverlay);
+  GLint overlay_location =
+      GL(GetUniformLocation, program_overlay_.program, "s_overlay");
+  GL(Uniform1i, overlay_location, 1);
+  program_overlay_.overlay_alpha_location =
+      GL(GetUniformLocation, program_overlay_.program, "v_overlay_alpha");
+  return &program_overlay_;
+}
+
+// Once the state settles a frame is drawn with a single DrawArrays: the
+// program stays in use between frames and only what changed is set.
+void TextureRenderer::DrawWith(Program* program, int width, int height,
+                               float overlay_alpha) {
+  UseProgram(program->program);
+  if (program->overlay_alpha_location >= 0) {
+    if (program->overlay_alpha != overlay_alpha) {
+      GL(Uniform1f, program->overlay_alpha_location, overlay_alpha);
+      program->overlay_alpha = overlay_alpha;
+    }
+    BindTexture(1, overlay_texture_);
+  }
+  SetViewport(width, height);
+  BindTexture(0, textures_[current_]);
+  GL(DrawArrays, GL_TRIANGLE_STRIP, 0, 4);
+}
+
+void TextureRenderer::Draw(int width, int height) {
+  DrawWith(Program2DOnce(), width, height, 0);
+}
+
+void TextureRenderer::DrawOverlay(int width, int height,
+                                  bool overlay_visible) {
+  DrawWith(ProgramOverlayOnce(), width, height,
+           overlay_visible && overlay_texture_ ? 1.0 : 0.0);
+}
+
+void TextureRenderer::Clear(float red, float green, float blue, float alpha) {
+  GL(ClearColor, red, green, blue, alpha);
+  GL(Clear, GL_COLOR_BUFFER_BIT);
+}
+
+unsigned TextureRenderer::TextureBytes() const {
+  unsigned bytes = 0;
+  for (int i = 0; i < kMaxPoolSize; i++) {
+    if (textures_[i])
+      bytes += width_ * height_ * BytesPerPixel();
+  }
+  if (overlay_texture_)
+    bytes += width_ * height_ * 4;
+  return bytes;
+}
+
+int TextureRenderer::MaxTextureSize() {
+  GLint size = 0;
+  GL(GetIntegerv, GL_MAX_TEXTURE_SIZE, &size);
+  return size;
+}
+
+bool TextureRenderer::NoGLError() {
+  return GL(GetError) == GL_NO_ERROR;
+}
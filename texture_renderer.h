@@ -0,0 +1,120 @@
+/*
+ * texture_renderer.h
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#ifndef PPAPI_GSTREAMER_TEXTURE_RENDERER_H_
+#define PPAPI_GSTREAMER_TEXTURE_RENDERER_H_
+
+#include "ppapi/c/pp_resource.h"
+#include "ppapi/c/ppb_opengles2.h"
+
+// Uploads decoded frames to textures and draws them with GLES2. The GL
+// entry points come from a PPB_OpenGLES2 table: the browser's one in the
+// plugin, or the offscreen EGL one of gl_backend_egl.h in the render
+// benchmark, so the same code is measured in both.
+//
+// Every call crosses the PPAPI proxy into the GPU command buffer, so the
+// bound program, textures, viewport and uniforms are cached and only set
+// when they change. The cache assumes nobody else changes that state on
+// the context between SetContext and Release.
+class TextureRenderer {
+ public:
+  // Largest texture pool, see SetFrameFormat.
+  static const int kMaxPoolSize = 4;
+
+  TextureRenderer(const PPB_OpenGLES2* gl, PP_Resource context);
+  ~TextureRenderer();
+
+  // A new (or lost, 0) context: the GL objects of the previous one are
+  // forgotten, not deleted.
+  void SetContext(PP_Resource context);
+  // Deletes the GL objects while the context is still alive.
+  void Release();
+
+  // Frames are width x height pixels of GL_RGB or GL_RGBA bytes. With a
+  // pool of more than one texture every frame goes to the texture the
+  // previous draws are not reading anymore, so that the upload does not
+  // wait for them. filter is GL_NEAREST or GL_LINEAR.
+  void SetFrameFormat(int width, int height, GLenum format, int pool_size,
+                      GLenum filter);
+  void UploadFrame(const void* data);
+  // Updates a part of the current texture, for single texture pools. The
+  // texture is allocated black on the first call.
+  void UploadFrameRect(int x, int y, int width, int height, const void* data);
+  // Frame sized RGBA subtitles, blended over the frame by DrawOverlay.
+  void UploadOverlay(const void* data);
+
+  // Draw the current frame over a width x height viewport.
+  void Draw(int width, int height);
+  void DrawOverlay(int width, int height, bool overlay_visible);
+  void Clear(float red, float green, float blue, float alpha);
+
+  // Texture memory allocated, in bytes.
+  unsigned TextureBytes() const;
+  // GL_MAX_TEXTURE_SIZE of the context, a round trip to the GPU process.
+  int MaxTextureSize();
+  bool NoGLError();
+  // GL commands issued since the previous call.
+  unsigned TakeCommands();
+
+ private:
+  // Frames on unit 0, subtitle overlay on unit 1.
+  static const int kTextureUnits = 2;
+
+  struct Program {
+    Program() : program(0), overlay_alpha_location(-1), overlay_alpha(-1) {}
+
+    GLuint program;
+    GLint overlay_alpha_location;
+    // Last value given to the uniform.
+    float overlay_alpha;
+  };
+
+  // What the renderer last set on the context.
+  struct State {
+    GLuint program;
+    GLuint active_unit;
+    GLuint textures[kTextureUnits];
+    int viewport_width;
+    int viewport_height;
+    GLint unpack_alignment;
+  };
+
+  int BytesPerPixel() const;
+  void ForgetObjects();
+  void ResetState();
+  void DeleteTextures();
+  void UseProgram(GLuint program);
+  void BindTexture(GLuint unit, GLuint texture);
+  void SetViewport(int width, int height);
+  void SetUnpackAlignment(int row_bytes);
+  void AllocateTexture(GLuint unit, GLuint* texture, GLenum format,
+                       GLenum filter, const void* data);
+  void CreateShader(GLuint program, GLenum type, const char* source);
+  void CreateVertexBufferOnce();
+  Program CreateProgram(const char* fragment_shader);
+  Program* Program2DOnce();
+  Program* ProgramOverlayOnce();
+  void DrawWith(Program* program, int width, int height, float overlay_alpha);
+
+  const PPB_OpenGLES2* gl_;
+  PP_Resource context_;
+
+  int width_;
+  int height_;
+  GLenum format_;
+  GLenum filter_;
+  int pool_size_;
+  int current_;
+  GLuint textures_[kMaxPoolSize];
+  GLuint overlay_texture_;
+  GLuint vertex_buffer_;
+  Program program_2d_;
+  Program program_overlay_;
+  State state_;
+  unsigned commands_;
+};
+
+#endif  // PPAPI_GSTREAMER_TEXTURE_RENDERER_H_
@@ -0,0 +1,564 @@
+/*
+ * thumbnail_gstreamer.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+#include "ppapi/c/pp_errors.h"
+
+#include "thumbnail_gstreamer.h"
+
+/* Preview frames are extracted by a dedicated playbin, video only, which
+ * is prerolled after a key unit seek: only the keyframe at the requested
+ * position is decoded, then scaled down and converted to RGBA by playbin's
+ * convert-sample action. Results are cached in memory and on disk, keyed
+ * by uri, timestamp and size. */
+
+#define THUMBNAIL_MEMORY_CACHE_BYTES (8 * 1024 * 1024)
+#define THUMBNAIL_DISK_CACHE_BYTES (64 * 1024 * 1024)
+#define THUMBNAIL_PREROLL_TIMEOUT (5 * GST_SECOND)
+/* how often a preroll wait looks at the quit flag */
+#define THUMBNAIL_PREROLL_STEP (100 * GST_MSECOND)
+#define THUMBNAIL_MAX_BATCH 1000
+#define THUMBNAIL_FILE_MAGIC "GSTTHMB1"
+
+/* same as GST_PLAY_FLAG_VIDEO in video_decoder_gstreamer.cc */
+#define THUMBNAIL_PLAY_FLAG_VIDEO (1 << 0)
+
+typedef struct _ThumbnailRequest {
+  gchar *uri;          /* NULL asks the worker to quit */
+  gint64 time_ms;
+  gint count;          /* > 0 for a batch */
+} ThumbnailRequest;
+
+typedef struct _CacheEntry {
+  gchar *key;
+  guint8 *rgba;
+  gsize size;
+} CacheEntry;
+
+typedef struct _ThumbnailGstreamer {
+  int width;
+  int height;
+  ThumbnailReady ready;
+  void *user_data;
+
+  GThread *thread;
+  GAsyncQueue *requests;
+  GAsyncQueue *results;
+  volatile gint quit;     /* set by destroy, checked between frames */
+
+  /* only touched by the worker thread */
+  GstElement *playbin;
+  gchar *uri;
+  GHashTable *memory;     /* key -> GList link in lru */
+  GQueue lru;             /* CacheEntry, most recently used first */
+  gsize memory_bytes;
+  gchar *disk_dir;
+  gint64 disk_bytes;
+} ThumbnailGstreamer;
+
+/* g_memdup takes a guint size and is deprecated, g_memdup2 is too recent */
+static guint8 *memdup (const void *data, gsize size)
+{
+    guint8 *copy = (guint8 *) g_malloc (size);
+    memcpy (copy, data, size);
+    return copy;
+}
+
+static void request_free (ThumbnailRequest *request)
+{
+    g_free (request->uri);
+    g_free (request);
+}
+
+static void cache_entry_free (CacheEntry *entry)
+{
+    g_free (entry->key);
+    g_free (entry->rgba);
+    g_free (entry);
+}
+
+static gchar *cache_key (ThumbnailGstreamer *thumb, const gchar *uri, gint64 time_ms)
+{
+    return g_strdup_printf ("%s@%" G_GINT64_FORMAT "@%dx%d",
+            uri, time_ms, thumb->width, thumb->height);
+}
+
+static gchar *disk_cache_path (ThumbnailGstreamer *thumb, const gchar *key)
+{
+    gchar *hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+    gchar *name = g_strconcat (hash, ".rgba", NULL);
+    gchar *path = g_build_filename (thumb->disk_dir, name, NULL);
+    g_free (name);
+    g_free (hash);
+    return path;
+}
+
+static void memory_cache_insert (ThumbnailGstreamer *thumb, const gchar *key,
+        const guint8 *rgba, gsize size)
+{
+    CacheEntry *entry;
+
+    if (size > THUMBNAIL_MEMORY_CACHE_BYTES)
+        return;
+    while (thumb->memory_bytes + size > THUMBNAIL_MEMORY_CACHE_BYTES) {
+        entry = (CacheEntry *) g_queue_pop_tail (&thumb->lru);
+        g_hash_table_remove (thumb->memory, entry->key);
+        thumb->memory_bytes -= entry->size;
+        cache_entry_free (entry);
+    }
+
+    entry = g_new0 (CacheEntry, 1);
+    entry->key = g_strdup (key);
+    entry->rgba = memdup (rgba, size);
+    entry->size = size;
+    g_queue_push_head (&thumb->lru, entry);
+    g_hash_table_insert (thumb->memory, entry->key, thumb->lru.head);
+    thumb->memory_bytes += size;
+}
+
+static guint8 *memory_cache_lookup (ThumbnailGstreamer *thumb, const gchar *key)
+{
+    GList *link = (GList *) g_hash_table_lookup (thumb->memory, key);
+    CacheEntry *entry;
+
+    if (!link)
+        return NULL;
+    g_queue_unlink (&thumb->lru, link);
+    g_queue_push_head_link (&thumb->lru, link);
+    entry = (CacheEntry *) link->data;
+    return memdup (entry->rgba, entry->size);
+}
+
+typedef struct _DiskFile {
+  gchar *path;
+  time_t mtime;
+  gint64 size;
+} DiskFile;
+
+static gint disk_file_compare (gconstpointer a, gconstpointer b)
+{
+    const DiskFile *fa = *(const DiskFile **) a;
+    const DiskFile *fb = *(const DiskFile **) b;
+    return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+static void disk_file_free (gpointer data)
+{
+    DiskFile *file = (DiskFile *) data;
+    g_free (file->path);
+    g_free (file);
+}
+
+/* Recomputes the disk usage and, when prune is set and the cache is over
+ * budget, deletes the oldest files down to 3/4 of the budget. */
+static void disk_cache_scan (ThumbnailGstreamer *thumb, bool prune)
+{
+    GDir *dir = g_dir_open (thumb->disk_dir, 0, NULL);
+    GPtrArray *files = g_ptr_array_new_with_free_func (disk_file_free);
+    const gchar *name;
+    guint i;
+
+    thumb->disk_bytes = 0;
+    if (!dir)
+        goto done;
+    while ((name = g_dir_read_name (dir))) {
+        GStatBuf st;
+        DiskFile *file;
+        gchar *path = g_build_filename (thumb->disk_dir, name, NULL);
+
+        if (g_stat (path, &st) != 0) {
+            g_free (path);
+            continue;
+        }
+        file = g_new0 (DiskFile, 1);
+        file->path = path;
+        file->mtime = st.st_mtime;
+        file->size = st.st_size;
+        thumb->disk_bytes += st.st_size;
+        g_ptr_array_add (files, file);
+    }
+    g_dir_close (dir);
+
+    if (!prune || thumb->disk_bytes <= THUMBNAIL_DISK_CACHE_BYTES)
+        goto done;
+    g_ptr_array_sort (files, disk_file_compare);
+    for (i = 0; i < files->len &&
+            thumb->disk_bytes > THUMBNAIL_DISK_CACHE_BYTES / 4 * 3; i++) {
+        DiskFile *file = (DiskFile *) g_ptr_array_index (files, i);
+        if (g_unlink (file->path) == 0)
+            thumb->disk_bytes -= file->size;
+    }
+
+done:
+    g_ptr_array_free (files, TRUE);
+}
+
+static void disk_cache_insert (ThumbnailGstreamer *thumb, const gchar *key,
+        const guint8 *rgba, gsize size)
+{
+    gsize header = strlen (THUMBNAIL_FILE_MAGIC) + 2 * sizeof (gint32);
+    guint8 *contents = (guint8 *) g_malloc (header + size);
+    gint32 dims[2] = { thumb->width, thumb->height };
+    gchar *path = disk_cache_path (thumb, key);
+
+    memcpy (contents, THUMBNAIL_FILE_MAGIC, strlen (THUMBNAIL_FILE_MAGIC));
+    memcpy (contents + strlen (THUMBNAIL_FILE_MAGIC), dims, sizeof (dims));
+    memcpy (contents + header, rgba, size);
+    if (g_file_set_contents (path, (const gchar *) contents, header + size, NULL)) {
+        thumb->disk_bytes += header + size;
+        if (thumb->disk_bytes > THUMBNAIL_DISK_CACHE_BYTES)
+            disk_cache_scan (thumb, true);
+    }
+    g_free (contents);
+    g_free (path);
+}
+
+static guint8 *disk_cache_lookup (ThumbnailGstreamer *thumb, const gchar *key)
+{
+    gsize header = strlen (THUMBNAIL_FILE_MAGIC) + 2 * sizeof (gint32);
+    gsize size = (gsize) thumb->width * thumb->height * 4;
+    gchar *path = disk_cache_path (thumb, key);
+    gchar *contents = NULL;
+    gsize length = 0;
+    guint8 *rgba = NULL;
+
+    if (g_file_get_contents (path, &contents, &length, NULL) &&
+        length == header + size &&
+        memcmp (contents, THUMBNAIL_FILE_MAGIC, strlen (THUMBNAIL_FILE_MAGIC)) == 0) {
+        rgba = memdup (contents + header, size);
+    }
+    g_free (contents);
+    g_free (path);
+    return rgba;
+}
+
+/* Waits for the preroll in short steps, giving up when destroy is waiting.
+ * A preroll still in progress after THUMBNAIL_PREROLL_TIMEOUT fails. */
+static bool thumbnail_wait_preroll (ThumbnailGstreamer *thumb)
+{
+    GstClockTime waited;
+
+    for (waited = 0; waited < THUMBNAIL_PREROLL_TIMEOUT;
+         waited += THUMBNAIL_PREROLL_STEP) {
+        if (g_atomic_int_get (&thumb->quit))
+            return false;
+        switch (gst_element_get_state (thumb->playbin, NULL, NULL,
+                    THUMBNAIL_PREROLL_STEP)) {
+        case GST_STATE_CHANGE_SUCCESS:
+        case GST_STATE_CHANGE_NO_PREROLL:
+            return true;
+        case GST_STATE_CHANGE_FAILURE:
+            return false;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+/* Nothing watches the bus of the playbin, which stays in PAUSED between
+ * requests: what it posted during the preroll is dropped, errors logged. */
+static bool thumbnail_preroll (ThumbnailGstreamer *thumb)
+{
+    bool prerolled = thumbnail_wait_preroll (thumb);
+    GstBus *bus = gst_element_get_bus (thumb->playbin);
+    GstMessage *msg;
+
+    while ((msg = gst_bus_pop (bus))) {
+        if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+            GError *err;
+            gchar *debug;
+
+            gst_message_parse_error (msg, &err, &debug);
+            g_printerr ("thumbnail: %s\n", err->message);
+            g_error_free (err);
+            g_free (debug);
+        }
+        gst_message_unref (msg);
+    }
+    gst_object_unref (bus);
+    return prerolled;
+}
+
+static void thumbnail_close (ThumbnailGstreamer *thumb)
+{
+    if (thumb->playbin) {
+        gst_element_set_state (thumb->playbin, GST_STATE_NULL);
+        gst_object_unref (thumb->playbin);
+        thumb->playbin = NULL;
+    }
+    g_free (thumb->uri);
+    thumb->uri = NULL;
+}
+
+static bool thumbnail_open (ThumbnailGstreamer *thumb, const gchar *uri)
+{
+    if (thumb->playbin && g_strcmp0 (thumb->uri, uri) == 0)
+        return true;
+    thumbnail_close (thumb);
+
+    thumb->playbin = gst_element_factory_make ("playbin", "thumbnailer");
+    if (!thumb->playbin)
+        return false;
+    g_object_set (thumb->playbin, "uri", uri,
+            "video-sink", gst_element_factory_make ("fakesink", "thumbvsink"),
+            "audio-sink", gst_element_factory_make ("fakesink", "thumbasink"),
+            "flags", THUMBNAIL_PLAY_FLAG_VIDEO,
+            NULL);
+
+    gst_element_set_state (thumb->playbin, GST_STATE_PAUSED);
+    if (!thumbnail_preroll (thumb)) {
+        g_printerr ("thumbnail: unable to preroll %s\n", uri);
+        thumbnail_close (thumb);
+        return false;
+    }
+    thumb->uri = g_strdup (uri);
+    return true;
+}
+
+static guint8 *thumbnail_grab (ThumbnailGstreamer *thumb, gint64 time_ms)
+{
+    GstSample *sample = NULL;
+    GstCaps *caps;
+    GstBuffer *buffer;
+    GstMapInfo mapinfo = { 0, };
+    gsize size = (gsize) thumb->width * thumb->height * 4;
+    guint8 *rgba = NULL;
+
+    if (!gst_element_seek_simple (thumb->playbin, GST_FORMAT_TIME,
+                (GstSeekFlags) (GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT),
+                time_ms * GST_MSECOND))
+        return NULL;
+    if (!thumbnail_preroll (thumb))
+        return NULL;
+
+    caps = gst_caps_new_simple ("video/x-raw",
+            "format", G_TYPE_STRING, "RGBA",
+            "width", G_TYPE_INT, thumb->width,
+            "height", G_TYPE_INT, thumb->height,
+            "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+            NULL);
+    g_signal_emit_by_name (thumb->playbin, "convert-sample", caps, &sample);
+    gst_caps_unref (caps);
+    if (!sample)
+        return NULL;
+
+    buffer = gst_sample_get_buffer (sample);
+    if (buffer && gst_buffer_map (buffer, &mapinfo, GST_MAP_READ)) {
+        if (mapinfo.size >= size)
+            rgba = memdup (mapinfo.data, size);
+        gst_buffer_unmap (buffer, &mapinfo);
+    }
+    gst_sample_unref (sample);
+    return rgba;
+}
+
+/* -1 when unknown, live streams for instance */
+static gint64 thumbnail_duration_ms (ThumbnailGstreamer *thumb)
+{
+    gint64 duration = 0;
+
+    if (!gst_element_query_duration (thumb->playbin, GST_FORMAT_TIME, &duration) ||
+        duration <= 0)
+        return -1;
+    return duration / GST_MSECOND;
+}
+
+static void thumbnail_post (ThumbnailGstreamer *thumb, ThumbnailResult *result)
+{
+    g_async_queue_push (thumb->results, result);
+    if (thumb->ready)
+        thumb->ready (thumb->user_data);
+}
+
+/* Answers a request that failed as a whole with a single result */
+static void thumbnail_fail (ThumbnailGstreamer *thumb, const gchar *uri,
+        const char *error)
+{
+    ThumbnailResult *result = g_new0 (ThumbnailResult, 1);
+
+    g_printerr ("thumbnail: %s: %s\n", uri, error);
+    result->uri = g_strdup (uri);
+    result->time_ms = -1;
+    result->width = thumb->width;
+    result->height = thumb->height;
+    result->error = error;
+    thumbnail_post (thumb, result);
+}
+
+/* Returns true when the frame came from one of the caches */
+static bool thumbnail_extract (ThumbnailGstreamer *thumb, const gchar *uri,
+        gint64 time_ms)
+{
+    gsize size = (gsize) thumb->width * thumb->height * 4;
+    gchar *key = cache_key (thumb, uri, time_ms);
+    ThumbnailResult *result = g_new0 (ThumbnailResult, 1);
+    bool cached = true;
+    guint8 *rgba;
+
+    rgba = memory_cache_lookup (thumb, key);
+    if (!rgba && (rgba = disk_cache_lookup (thumb, key)))
+        memory_cache_insert (thumb, key, rgba, size);
+    if (!rgba && thumbnail_open (thumb, uri)) {
+        cached = false;
+        rgba = thumbnail_grab (thumb, time_ms);
+        if (rgba) {
+            memory_cache_insert (thumb, key, rgba, size);
+            disk_cache_insert (thumb, key, rgba, size);
+        }
+    }
+
+    result->uri = g_strdup (uri);
+    result->time_ms = time_ms;
+    result->width = thumb->width;
+    result->height = thumb->height;
+    result->rgba = rgba;
+    thumbnail_post (thumb, result);
+
+    g_free (key);
+    return cached;
+}
+
+static gpointer thumbnail_thread (gpointer user_data)
+{
+    ThumbnailGstreamer *thumb = (ThumbnailGstreamer *) user_data;
+    ThumbnailRequest *request;
+
+    g_mkdir_with_parents (thumb->disk_dir, 0700);
+    disk_cache_scan (thumb, true);
+
+    while ((request = (ThumbnailRequest *) g_async_queue_pop (thumb->requests))) {
+        gint64 start = g_get_monotonic_time ();
+        gint total = 1, cached = 0, i;
+
+        if (!request->uri) {
+            request_free (request);
+            break;
+        }
+        if (request->count > 0) {
+            gint64 duration = -1;
+
+            total = request->count;
+            if (!thumbnail_open (thumb, request->uri)) {
+                thumbnail_fail (thumb, request->uri, "unable to open");
+                total = 0;
+            } else if ((duration = thumbnail_duration_ms (thumb)) < 0) {
+                /* rather than count frames of the start */
+                thumbnail_fail (thumb, request->uri, "duration unknown");
+                total = 0;
+            }
+            /* destroy does not wait for the rest of the batch */
+            for (i = 0; i < total && !g_atomic_int_get (&thumb->quit); i++) {
+                /* middle of each of the count equal slices */
+                gint64 time_ms = duration * (2 * i + 1) / (2 * total);
+                cached += thumbnail_extract (thumb, request->uri, time_ms);
+            }
+        } else {
+            cached += thumbnail_extract (thumb, request->uri, request->time_ms);
+        }
+
+        gdouble elapsed = (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC;
+        g_print ("--[STATS] thumbnails: %d in %.3f s (%.1f/s, %d cached)\n",
+                total, elapsed, elapsed > 0 ? total / elapsed : 0.0, cached);
+        request_free (request);
+    }
+
+    thumbnail_close (thumb);
+    return NULL;
+}
+
+void *ThumbnailGstreamer_create(int width, int height,
+        ThumbnailReady ready, void *user_data)
+{
+    ThumbnailGstreamer *thumb = g_new0 (ThumbnailGstreamer, 1);
+
+    gst_init (NULL, NULL);
+
+    thumb->width = width;
+    thumb->height = height;
+    thumb->ready = ready;
+    thumb->user_data = user_data;
+    thumb->requests = g_async_queue_new ();
+    thumb->results = g_async_queue_new ();
+    thumb->memory = g_hash_table_new (g_str_hash, g_str_equal);
+    g_queue_init (&thumb->lru);
+    thumb->disk_dir = g_build_filename (g_get_user_cache_dir (),
+            "ppapi-gstreamer", "thumbnails", NULL);
+    thumb->thread = g_thread_new ("gst-thumbnails", thumbnail_thread, thumb);
+    return thumb;
+}
+
+void ThumbnailGstreamer_destroy(void *gst)
+{
+    ThumbnailGstreamer *thumb = (ThumbnailGstreamer *) gst;
+    ThumbnailRequest *request;
+    ThumbnailResult *result;
+    CacheEntry *entry;
+
+    /* the quit request goes first, pending ones are dropped, the batch in
+     * progress stops at the next frame */
+    g_atomic_int_set (&thumb->quit, 1);
+    g_async_queue_push_front (thumb->requests, g_new0 (ThumbnailRequest, 1));
+    g_thread_join (thumb->thread);
+
+    while ((request = (ThumbnailRequest *) g_async_queue_try_pop (thumb->requests)))
+        request_free (request);
+    g_async_queue_unref (thumb->requests);
+    while ((result = ThumbnailGstreamer_popResult (thumb)))
+        ThumbnailGstreamer_freeResult (result);
+    g_async_queue_unref (thumb->results);
+    while ((entry = (CacheEntry *) g_queue_pop_head (&thumb->lru)))
+        cache_entry_free (entry);
+    g_hash_table_destroy (thumb->memory);
+    g_free (thumb->disk_dir);
+    g_free (thumb);
+}
+
+int32_t ThumbnailGstreamer_request(void *gst, const char *uri, int64_t time_ms)
+{
+    ThumbnailGstreamer *thumb = (ThumbnailGstreamer *) gst;
+    ThumbnailRequest *request;
+
+    if (!uri || time_ms < 0)
+        return PP_ERROR_BADARGUMENT;
+    request = g_new0 (ThumbnailRequest, 1);
+    request->uri = g_strdup (uri);
+    request->time_ms = time_ms;
+    g_async_queue_push (thumb->requests, request);
+    return PP_OK_COMPLETIONPENDING;
+}
+
+int32_t ThumbnailGstreamer_requestBatch(void *gst, const char *uri, int count)
+{
+    ThumbnailGstreamer *thumb = (ThumbnailGstreamer *) gst;
+    ThumbnailRequest *request;
+
+    if (!uri || count <= 0 || count > THUMBNAIL_MAX_BATCH)
+        return PP_ERROR_BADARGUMENT;
+    request = g_new0 (ThumbnailRequest, 1);
+    request->uri = g_strdup (uri);
+    request->count = count;
+    g_async_queue_push (thumb->requests, request);
+    return PP_OK_COMPLETIONPENDING;
+}
+
+ThumbnailResult *ThumbnailGstreamer_popResult(void *gst)
+{
+    ThumbnailGstreamer *thumb = (ThumbnailGstreamer *) gst;
+    return (ThumbnailResult *) g_async_queue_try_pop (thumb->results);
+}
+
+void ThumbnailGstreamer_freeResult(ThumbnailResult *result)
+{
+    g_free (result->uri);
+    g_free (result->rgba);
+    g_free (result);
+}
@@ -0,0 +1,41 @@
+/*
+ * thumbnail_gstreamer.h
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#ifndef PPAPI_GSTREAMER_THUMBNAIL_H_
+#define PPAPI_GSTREAMER_THUMBNAIL_H_
+
+#include <stdint.h>
+
+/* A decoded preview frame, rgba is width * height * 4 bytes or NULL when
+ * the frame could not be extracted */
+typedef struct _ThumbnailResult {
+  char *uri;
+  int64_t time_ms;          /* -1 with error */
+  int width;
+  int height;
+  unsigned char *rgba;
+  const char *error;        /* static, set when the whole request failed */
+} ThumbnailResult;
+
+/* Called from the thumbnail worker thread whenever results are ready to be
+ * collected with ThumbnailGstreamer_popResult. */
+typedef void (*ThumbnailReady)(void *user_data);
+
+void *ThumbnailGstreamer_create(int width, int height,
+        ThumbnailReady ready, void *user_data);
+void ThumbnailGstreamer_destroy(void *thumb);
+
+/* Both return PP_ERROR_BADARGUMENT for a negative time or a count out of
+ * 1..1000, PP_OK_COMPLETIONPENDING otherwise */
+int32_t ThumbnailGstreamer_request(void *thumb, const char *uri, int64_t time_ms);
+/* count thumbnails evenly spaced over the duration of uri, a single result
+ * with an error when the duration is unknown */
+int32_t ThumbnailGstreamer_requestBatch(void *thumb, const char *uri, int count);
+
+ThumbnailResult *ThumbnailGstreamer_popResult(void *thumb);
+void ThumbnailGstreamer_freeResult(ThumbnailResult *result);
+
+#endif /*  PPAPI_GSTREAMER_THUMBNAIL_H_ */
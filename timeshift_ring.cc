@@ -0,0 +1,305 @@
+/*
+ * timeshift_ring.cc
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <glib.h>
+#include "ppapi/c/pp_errors.h"
+
+#include "timeshift_ring.h"
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+
+/* index entries, a new one every random access point of the video PES */
+#define TIMESHIFT_INDEX_SIZE 4096
+/* dirty pages are handed to writeback in chunks of this size, so the
+ * disk sees a steady sequential write instead of bursts at eviction */
+#define TIMESHIFT_FLUSH_BYTES (1024 * 1024)
+#define TIMESHIFT_EXPORT_CHUNK (64 * 1024)
+
+typedef struct _TimeshiftIndexEntry {
+  uint64_t offset;
+  int64_t time_us;
+} TimeshiftIndexEntry;
+
+typedef struct _TimeshiftRing {
+  GMutex lock;
+  int fd;
+  uint8_t *data;
+  uint64_t size;
+
+  uint64_t head;
+  uint64_t flushed;      /* bytes handed to writeback */
+  uint64_t parsed;       /* next TS packet to look at */
+
+  TimeshiftIndexEntry index[TIMESHIFT_INDEX_SIZE];
+  guint index_first;
+  guint index_count;
+} TimeshiftRing;
+
+static uint64_t ring_tail (TimeshiftRing *ring)
+{
+    return ring->head > ring->size ? ring->head - ring->size : 0;
+}
+
+static uint8_t ring_byte (TimeshiftRing *ring, uint64_t offset)
+{
+    return ring->data[offset % ring->size];
+}
+
+static void ring_copy (TimeshiftRing *ring, uint64_t offset, uint8_t *dest,
+        uint32_t size)
+{
+    uint64_t pos = offset % ring->size;
+    uint64_t first = MIN ((uint64_t) size, ring->size - pos);
+
+    memcpy (dest, ring->data + pos, first);
+    if (first < size)
+        memcpy (dest + first, ring->data, size - first);
+}
+
+static void index_drop_stale (TimeshiftRing *ring)
+{
+    uint64_t tail = ring_tail (ring);
+
+    while (ring->index_count &&
+           ring->index[ring->index_first].offset < tail) {
+        ring->index_first = (ring->index_first + 1) % TIMESHIFT_INDEX_SIZE;
+        ring->index_count--;
+    }
+}
+
+static void index_append (TimeshiftRing *ring, uint64_t offset, int64_t time_us)
+{
+    guint last;
+
+    if (ring->index_count == TIMESHIFT_INDEX_SIZE) {
+        ring->index_first = (ring->index_first + 1) % TIMESHIFT_INDEX_SIZE;
+        ring->index_count--;
+    }
+    last = (ring->index_first + ring->index_count) % TIMESHIFT_INDEX_SIZE;
+    ring->index[last].offset = offset;
+    ring->index[last].time_us = time_us;
+    ring->index_count++;
+}
+
+/* A packet starts a video access unit we can decode from when its
+ * adaptation field has the random_access_indicator and its payload starts
+ * a PES packet of a video stream (stream_id 0xe0-0xef). */
+static bool ts_packet_is_video_rap (TimeshiftRing *ring, uint64_t packet)
+{
+    uint8_t b1 = ring_byte (ring, packet + 1);
+    uint8_t b3 = ring_byte (ring, packet + 3);
+    uint8_t af_length;
+    uint64_t payload;
+
+    if (!(b1 & 0x40) || !(b3 & 0x20) || !(b3 & 0x10))
+        return false;
+    af_length = ring_byte (ring, packet + 4);
+    if (af_length == 0 || !(ring_byte (ring, packet + 5) & 0x40))
+        return false;
+    payload = packet + 5 + af_length;
+    if (payload + 4 > packet + TS_PACKET_SIZE)
+        return false;
+    return ring_byte (ring, payload) == 0 &&
+           ring_byte (ring, payload + 1) == 0 &&
+           ring_byte (ring, payload + 2) == 1 &&
+           (ring_byte (ring, payload + 3) & 0xf0) == 0xe0;
+}
+
+static void ts_parse (TimeshiftRing *ring, int64_t time_us)
+{
+    if (ring->parsed < ring_tail (ring))
+        ring->parsed = ring_tail (ring);
+
+    while (ring->parsed + TS_PACKET_SIZE <= ring->head) {
+        if (ring_byte (ring, ring->parsed) != TS_SYNC_BYTE) {
+            /* lost sync, look for the next sync byte */
+            ring->parsed++;
+            continue;
+        }
+        if (ts_packet_is_video_rap (ring, ring->parsed))
+            index_append (ring, ring->parsed, time_us);
+        ring->parsed += TS_PACKET_SIZE;
+    }
+}
+
+static void ring_flush (TimeshiftRing *ring)
+{
+    long page = sysconf (_SC_PAGESIZE);
+    uint64_t from = MAX (ring->flushed, ring_tail (ring));
+
+    if (ring->head - ring->flushed < TIMESHIFT_FLUSH_BYTES)
+        return;
+    while (from < ring->head) {
+        uint64_t pos = from % ring->size;
+        uint64_t length = MIN (ring->head - from, ring->size - pos);
+        uint64_t aligned = pos / page * page;
+
+        msync (ring->data + aligned, pos - aligned + length, MS_ASYNC);
+        from += length;
+    }
+    ring->flushed = ring->head;
+}
+
+void *TimeshiftRing_open(const char *path, uint64_t size)
+{
+    TimeshiftRing *ring;
+    int fd;
+    void *data;
+
+    fd = open (path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate (fd, size) != 0) {
+        close (fd);
+        return NULL;
+    }
+    data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close (fd);
+        return NULL;
+    }
+    madvise (data, size, MADV_SEQUENTIAL);
+
+    ring = g_new0 (TimeshiftRing, 1);
+    g_mutex_init (&ring->lock);
+    ring->fd = fd;
+    ring->data = (uint8_t *) data;
+    ring->size = size;
+    return ring;
+}
+
+void TimeshiftRing_close(void *handle)
+{
+    TimeshiftRing *ring = (TimeshiftRing *) handle;
+
+    munmap (ring->data, ring->size);
+    close (ring->fd);
+    g_mutex_clear (&ring->lock);
+    g_free (ring);
+}
+
+void TimeshiftRing_write(void *handle, const uint8_t *data, uint32_t size,
+        int64_t time_us)
+{
+    TimeshiftRing *ring = (TimeshiftRing *) handle;
+
+    g_mutex_lock (&ring->lock);
+    while (size > 0) {
+        uint64_t pos = ring->head % ring->size;
+        uint32_t chunk = MIN ((uint64_t) size, ring->size - pos);
+
+        memcpy (ring->data + pos, data, chunk);
+        ring->head += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    index_drop_stale (ring);
+    ts_parse (ring, time_us);
+    ring_flush (ring);
+    g_mutex_unlock (&ring->lock);
+}
+
+uint32_t TimeshiftRing_read(void *handle, uint64_t offset, uint8_t *data,
+        uint32_t size)
+{
+    TimeshiftRing *ring = (TimeshiftRing *) handle;
+    uint32_t count = 0;
+
+    g_mutex_lock (&ring->lock);
+    if (offset >= ring_tail (ring) && offset < ring->head) {
+        count = MIN ((uint64_t) size, ring->head - offset);
+        ring_copy (ring, offset, data, count);
+    }
+    g_mutex_unlock (&ring->lock);
+    return count;
+}
+
+uint64_t TimeshiftRing_head(void *handle)
+{
+    TimeshiftRing *ring = (TimeshiftRing *) handle;
+    uint64_t head;
+
+    g_mutex_lock (&ring->lock);
+    head = ring->head;
+    g_mutex_unlock (&ring->lock);
+    return head;
+}
+
+uint64_t TimeshiftRing_tail(void *handle)
+{
+    TimeshiftRing *ring = (TimeshiftRing *) handle;
+    uint64_t tail;
+
+    g_mutex_lock (&ring->lock);
+    tail = ring_tail (ring);
+    g_mutex_unlock (&ring->lock);
+    return tail;
+}
+
+bool TimeshiftRing_seekPoint(void *handle, int64_t time_us, uint64_t *offset)
+{
+    TimeshiftRing *ring = (TimeshiftRing *) handle;
+    bool found = false;
+    guint i;
+
+    g_mutex_lock (&ring->lock);
+    index_drop_stale (ring);
+    for (i = 0; i < ring->index_count; i++) {
+        TimeshiftIndexEntry *entry =
+                &ring->index[(ring->index_first + i) % TIMESHIFT_INDEX_SIZE];
+        if (found && entry->time_us > time_us)
+            break;
+        *offset = entry->offset;
+        found = true;
+    }
+    g_mutex_unlock (&ring->lock);
+    return found;
+}
+
+int32_t TimeshiftRing_export(void *handle, int64_t start_us, int64_t end_us,
+        const char *path)
+{
+    uint64_t offset, end;
+    uint8_t *chunk;
+    FILE *file;
+    int32_t result = PP_OK;
+
+    if (!TimeshiftRing_seekPoint (handle, start_us, &offset))
+        return PP_ERROR_FAILED;
+    if (end_us <= start_us || !TimeshiftRing_seekPoint (handle, end_us, &end) ||
+        end <= offset)
+        return PP_ERROR_BADARGUMENT;
+
+    file = fopen (path, "wb");
+    if (!file)
+        return PP_ERROR_NOACCESS;
+    chunk = (uint8_t *) g_malloc (TIMESHIFT_EXPORT_CHUNK);
+    while (offset < end) {
+        uint32_t count = TimeshiftRing_read (handle, offset, chunk,
+                MIN ((uint64_t) TIMESHIFT_EXPORT_CHUNK, end - offset));
+        /* overwritten by the recorder while exporting */
+        if (count == 0) {
+            result = PP_ERROR_FAILED;
+            break;
+        }
+        if (fwrite (chunk, 1, count, file) != count) {
+            result = PP_ERROR_FAILED;
+            break;
+        }
+        offset += count;
+    }
+    g_free (chunk);
+    fclose (file);
+    return result;
+}
@@ -0,0 +1,41 @@
+/*
+ * timeshift_ring.h
+ *
+ * Copyright (C) STMicroelectronics SA 2014
+ * License terms:  GNU General Public License (GPL), version 2
+ */
+#ifndef PPAPI_GSTREAMER_TIMESHIFT_RING_H_
+#define PPAPI_GSTREAMER_TIMESHIFT_RING_H_
+
+#include <stdint.h>
+
+/* Fixed-size, memory-mapped on-disk ring holding the last few minutes of a
+ * live MPEG-TS stream, with an index of its video random access points.
+ * Offsets are absolute byte counts since the ring was opened; the ring
+ * holds [tail, head). Times are g_get_monotonic_time() microseconds at
+ * which the bytes were written. All functions are thread safe. */
+
+void *TimeshiftRing_open(const char *path, uint64_t size);
+void TimeshiftRing_close(void *ring);
+
+/* Appends data, sequentially, overwriting the oldest bytes */
+void TimeshiftRing_write(void *ring, const uint8_t *data, uint32_t size,
+        int64_t time_us);
+/* Copies up to size bytes at offset, returns 0 when offset is no longer
+ * (or not yet) in the ring */
+uint32_t TimeshiftRing_read(void *ring, uint64_t offset, uint8_t *data,
+        uint32_t size);
+
+uint64_t TimeshiftRing_head(void *ring);
+uint64_t TimeshiftRing_tail(void *ring);
+
+/* Latest random access point written at or before time_us, or the oldest
+ * one still in the ring when time_us is older than the window */
+bool TimeshiftRing_seekPoint(void *ring, int64_t time_us, uint64_t *offset);
+
+/* Writes the stream between the random access points of start_us and
+ * end_us to path, PP_ERROR_BADARGUMENT when that range is empty */
+int32_t TimeshiftRing_export(void *ring, int64_t start_us, int64_t end_us,
+        const char *path);
+
+#endif /*  PPAPI_GSTREAMER_TIMESHIFT_RING_H_ */
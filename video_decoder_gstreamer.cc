@@ -9,6 +9,7 @@
 #include <stdio.h>
 
 #include <gst/gst.h>
+#include <glib/gstdio.h>
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
@@ -17,8 +18,38 @@
 #include <unistd.h>
 #include "ppapi/c/pp_errors.h"
 
+#include "abr_controller.h"
+#include "audio_ring.h"
+#include "frame_capture.h"
+#include "timeshift_ring.h"
 #include "video_decoder_gstreamer.h"
 
+/* files named by the page (timeshift ring and exports, captures) live in
+ * <user cache dir>/CACHE_DIR_NAME */
+#define CACHE_DIR_NAME "ppapi-gstreamer"
+
+/* bytes handed to appsrc at once when playing from the timeshift ring */
+#define TIMESHIFT_CHUNK (64 * 1024)
+
+/* replay://<capture file name>[?speed=max] */
+#define REPLAY_URI_PREFIX "replay://"
+#define REPLAY_URI_MAX_SPEED "?speed=max"
+
+/* period the pipeline queue levels are sampled at, see getMemoryStats */
+#define MEMORY_INTERVAL_MS 1000
+
+/* adaptive bitrate sampling period */
+#define ABR_INTERVAL_MS 1000
+
+/* PPAPI audio output: the audio heard is resynchronized (samples dropped
+ * or silence inserted) when it drifts this far from the clock, and the
+ * latency reported to the sink follows the device in steps of at least
+ * AUDIO_LATENCY_STEP_US */
+#define AUDIO_RESYNC_US 20000
+#define AUDIO_LATENCY_STEP_US 5000
+#define AUDIO_INTERVAL_MS 1000
+#define AUDIO_STATS_TICKS 5
+
 typedef struct _VideoDecoderGstreamer {
   GstElement *playbin;
   GstElement *source;
@@ -30,8 +61,129 @@ typedef struct _VideoDecoderGstreamer {
   bool hole;
 
   GAsyncQueue *queue;
+  VideoDecoderDropPolicy drop_policy;
+  int max_queued;
+  int frame_width;
+  int frame_height;
+  volatile gint frames;
+  volatile gint dropped;
+
+  /* memory accounting, queued_bytes is protected by the queue lock */
+  gsize queued_bytes;
+  volatile gint texture_bytes;
+  guint budget_bytes;
+  volatile gint budget_drops;
+
+  /* subtitles rendered into their own RGBA frame, see overlay_cb. They
+   * expire in pipeline running time, which the clock of the pipeline and
+   * its base time give while playing and which stops while paused. */
+  VideoDecoderSubtitles subtitles;
+  GMutex overlay_lock;
+  GstBuffer *overlay;
+  bool overlay_shown;
+  GstClockTime overlay_expiry;      /* running time, NONE: until replaced */
+  GstClock *overlay_clock;
+  GstClockTime overlay_base_time;
+  GstClockTime overlay_paused_at;   /* running time, NONE while playing */
+
+  /* visibility */
+  volatile gint video_enabled;
+  guint hidden_flags;        /* playbin flags saved while video is skipped */
+  bool park_to_ready;
+  bool parked;
+  bool park_resume_playing;
+  gint64 park_position;
+
+  /* timeshift: recorder pipeline -> ring -> appsrc of playbin */
+  gchar *timeshift_path;
+  guint64 timeshift_size;
+  void *timeshift_ring;
+  GstElement *recorder;
+  GSource *recorder_watch;
+  GMutex timeshift_lock;    /* appsrc, timeshift_read and timeshift_ended */
+  GstElement *appsrc;
+  guint64 timeshift_read;
+  bool timeshift_ended;     /* the recorder source reached its end */
+  volatile gint timeshift_want;
+  gint64 timeshift_seek_start;
+
+  /* capture of the frames reaching buffers_cb, or replay of a capture
+   * through an appsrc pipeline standing in for playbin */
+  gchar *capture_path;
+  bool capture_payload;
+  void *capture;
+  GstCaps *capture_caps;
+  void *replay;
+  gint replay_frames;
+  gint64 replay_start;
+
+  /* adaptive bitrate, updated from the worker context only */
+  void *abr;
+  VideoDecoderAbrSwitch abr_switch;
+  void *abr_user_data;
+  GSource *abr_timer;
+  GstElement *abr_demux;
+  AbrDecision abr_decision;
+  bool abr_decided;
+  guint64 abr_fragment_bandwidth;  /* of the last downloaded fragment */
+  guint64 abr_variant_bitrate;     /* of the playlist hlsdemux switched to */
+  gint abr_variant_width;          /* of the decoded video, as last reported */
+  gint abr_variant_height;
+  bool abr_variant_changed;
+  guint64 qos_processed;           /* as last reported by the video sink */
+  guint64 qos_dropped;
+  guint64 abr_processed;           /* at the previous sample */
+  guint64 abr_dropped;
+
+  /* PCM for the PPAPI audio device instead of the native audio sink:
+   * audio_cb writes the ring from the sink streaming thread, readAudio
+   * reads it from the device thread, neither takes a lock */
+  int audio_rate;
+  int audio_channels;
+  void *audio_ring;
+  GstElement *audio_sink;
+  volatile gint audio_flush;
+  volatile gint audio_due_seq;     /* odd while the two below change */
+  gint64 audio_due_us;             /* monotonic time the byte at ... */
+  guint32 audio_due_position;      /* ... this ring position is due */
+  volatile gint audio_device_us;   /* as reported by the device */
+  volatile gint audio_period_us;   /* of a device callback */
+  volatile gint audio_offset_us;   /* how late the audio is heard */
+  volatile gint audio_resyncs;
+  volatile gint audio_underruns;
+  volatile gint audio_overruns;
+  bool audio_starved;              /* device thread only */
+  gint64 audio_latency_us;         /* reported to the sink as ts-offset */
+  GSource *audio_timer;            /* worker context */
+  guint audio_ticks;
+
+  /* window, applied once the pipeline exists, protected by command_lock */
+  int window_x, window_y, window_w, window_h;
+  GSource *bus_watch;
+  GSource *memory_timer;
+  volatile gint pipeline_bytes;    /* sampled by memory_tick */
+
+  /* command worker: the commands, the bus watch and the timers are all
+   * dispatched from the worker's own main context, so that the pipeline
+   * and the state above are only ever touched from that thread */
+  GThread *command_thread;
+  GMainContext *context;
+  GMainLoop *loop;
+  GMutex command_lock;
+  GQueue *commands;
+  bool quit;
+  gchar *url;               /* of the last INITIALIZE queued */
+  VideoDecoderCommandDone command_done;
+  void *command_user_data;
 } VideoDecoderGstreamer;
 
+typedef struct _DecoderCommand {
+  VideoDecoderCommand command;
+  gchar *arg;               /* url or export path */
+  gint64 from_ms;
+  gint64 to_ms;
+} DecoderCommand;
+
 /* playbin flags */
 typedef enum {
   GST_PLAY_FLAG_VIDEO           = (1 << 0), /* We want video output */
@@ -47,22 +199,932 @@ typedef enum {
   GST_PLAY_FLAG_SOFT_COLORBALANCE = (1 << 10)
 } GstPlayFlags;
 
+/* Pops the oldest queued object with the queue lock held */
+static GstMiniObject *queue_pop_unlocked (VideoDecoderGstreamer *decoder)
+{
+    GstMiniObject *object =
+            (GstMiniObject *)g_async_queue_try_pop_unlocked (decoder->queue);
+    if (object && GST_IS_BUFFER (object))
+        decoder->queued_bytes -= gst_buffer_get_size (GST_BUFFER_CAST (object));
+    return object;
+}
+
+static void queue_flush (VideoDecoderGstreamer *decoder)
+{
+    GstMiniObject *object;
+
+    if (!decoder->queue)
+        return;
+    g_async_queue_lock (decoder->queue);
+    while ((object = queue_pop_unlocked (decoder)))
+        gst_mini_object_unref (object);
+    g_async_queue_unlock (decoder->queue);
+}
+
+/* Dispatches func from the worker context, the reference to source
+ * stays with the caller */
+static GSource *decoder_attach (VideoDecoderGstreamer *decoder,
+        GSource *source, GSourceFunc func)
+{
+    g_source_set_callback (source, func, decoder, NULL);
+    g_source_attach (source, decoder->context);
+    return source;
+}
+
+static void decoder_detach (GSource **source)
+{
+    if (!*source)
+        return;
+    g_source_destroy (*source);
+    g_source_unref (*source);
+    *source = NULL;
+}
+
+/* Returns the path of name in the plugin cache directory, created on
+ * first use, or NULL when name is not a bare file name: the page must not
+ * get the plugin to write anywhere else. */
+static gchar *cache_path (const gchar *name)
+{
+    gchar *dir, *path;
+
+    if (!name || !*name || strcmp (name, ".") == 0 ||
+        strchr (name, '/') || strstr (name, ".."))
+        return NULL;
+    dir = g_build_filename (g_get_user_cache_dir (), CACHE_DIR_NAME, NULL);
+    g_mkdir_with_parents (dir, 0700);
+    path = g_build_filename (dir, name, NULL);
+    g_free (dir);
+    return path;
+}
+
+/* Bytes the frame queue may hold, 0 when unlimited */
+static gsize queue_budget (VideoDecoderGstreamer *decoder)
+{
+    gsize available = decoder->budget_bytes / 2;
+    gsize textures = g_atomic_int_get (&decoder->texture_bytes);
+
+    if (!decoder->budget_bytes)
+        return 0;
+    return available > textures ? available - textures : 1;
+}
+
+/* Called from the sink streaming thread only */
+static void capture_frame (VideoDecoderGstreamer *decoder, GstPad *pad,
+        GstBuffer *buffer)
+{
+    GstCaps *caps = gst_pad_get_current_caps (pad);
+    GstMapInfo mapinfo = { 0, };
+
+    if (caps && (!decoder->capture_caps ||
+                 !gst_caps_is_equal (caps, decoder->capture_caps))) {
+        gchar *str = gst_caps_to_string (caps);
+        FrameCapture_writeCaps (decoder->capture, str);
+        g_free (str);
+        gst_caps_replace (&decoder->capture_caps, caps);
+    }
+    if (caps)
+        gst_caps_unref (caps);
+
+    if (!gst_buffer_map (buffer, &mapinfo, GST_MAP_READ))
+        return;
+    /* GST_CLOCK_TIME_NONE is stored as -1 */
+    FrameCapture_writeFrame (decoder->capture, GST_BUFFER_PTS (buffer),
+            GST_BUFFER_DURATION (buffer), mapinfo.data, mapinfo.size);
+    gst_buffer_unmap (buffer, &mapinfo);
+}
+
 static void
 buffers_cb (GstElement * fakesink, GstBuffer * buffer, GstPad * pad,
         gpointer user_data)
 {
     VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    GstMiniObject *old;
+    gsize size = gst_buffer_get_size (buffer);
+    gsize budget = queue_budget (decoder);
     g_print("---buffers_cb\n");
 
-    g_async_queue_push (decoder->queue, gst_buffer_ref (buffer));
+    if (decoder->capture)
+        capture_frame (decoder, pad, buffer);
+
+    if (!g_atomic_int_get (&decoder->video_enabled))
+        return;
+
+    g_async_queue_lock (decoder->queue);
+    if (decoder->drop_policy != VIDEO_DECODER_DROP_NONE) {
+        gint keep = decoder->drop_policy == VIDEO_DECODER_DROP_TO_LATEST ?
+                0 : decoder->max_queued - 1;
+        while (g_async_queue_length_unlocked (decoder->queue) > keep &&
+               (old = queue_pop_unlocked (decoder))) {
+            gst_mini_object_unref (old);
+            g_atomic_int_inc (&decoder->dropped);
+        }
+    }
+    /* the newest frame is always kept, even alone over budget */
+    while (budget && decoder->queued_bytes + size > budget &&
+           (old = queue_pop_unlocked (decoder))) {
+        gst_mini_object_unref (old);
+        g_atomic_int_inc (&decoder->dropped);
+        g_atomic_int_inc (&decoder->budget_drops);
+    }
+    decoder->queued_bytes += size;
+    g_async_queue_push_unlocked (decoder->queue, gst_buffer_ref (buffer));
+    g_async_queue_unlock (decoder->queue);
+    g_atomic_int_inc (&decoder->frames);
 
     g_print("---buffers_cb <<<<\n");
 }
 
+/* Pushes the next frame of the capture. Frames are timestamped with the
+ * time they reached buffers_cb, so that a synchronized sink reproduces the
+ * original cadence; frames captured without payload are replayed black. */
+static void replay_need_data (GstElement *appsrc, guint length,
+        gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    FrameCaptureRecord record;
+    GstFlowReturn ret;
+
+    while (FrameCapture_read (decoder->replay, &record)) {
+        GstBuffer *buffer;
+
+        if (record.type == FRAME_CAPTURE_CAPS) {
+            GstCaps *caps = gst_caps_from_string ((const gchar *) record.data);
+            if (caps) {
+                g_object_set (appsrc, "caps", caps, NULL);
+                gst_caps_unref (caps);
+            }
+            continue;
+        }
+
+        /* the frame size is not covered by the reader's payload check */
+        buffer = record.frame_size <= FRAME_CAPTURE_MAX_RECORD ?
+                gst_buffer_new_allocate (NULL, record.frame_size, NULL) : NULL;
+        if (!buffer) {
+            GST_ELEMENT_ERROR (appsrc, STREAM, FAILED,
+                    ("Corrupted capture, frame of %u bytes.", record.frame_size),
+                    (NULL));
+            return;
+        }
+        if (record.data && record.size == record.frame_size)
+            gst_buffer_fill (buffer, 0, record.data, record.size);
+        else
+            gst_buffer_memset (buffer, 0, 0, record.frame_size);
+        GST_BUFFER_PTS (buffer) = record.arrival_us * GST_USECOND;
+        GST_BUFFER_DURATION (buffer) = record.duration;
+
+        if (!decoder->replay_frames++)
+            decoder->replay_start = g_get_monotonic_time ();
+        g_signal_emit_by_name (appsrc, "push-buffer", buffer, &ret);
+        gst_buffer_unref (buffer);
+        return;
+    }
+    g_signal_emit_by_name (appsrc, "end-of-stream", &ret);
+}
+
+/* appsrc ! fakesink, the sink hands frames to buffers_cb like the kmssink
+ * of the texture mode does. */
+static GstElement *replay_pipeline_new (VideoDecoderGstreamer *decoder,
+        const char *url)
+{
+    GstElement *pipeline, *source, *sink;
+    gchar *name = g_strdup (url + strlen (REPLAY_URI_PREFIX));
+    bool max_speed = g_str_has_suffix (name, REPLAY_URI_MAX_SPEED);
+    gchar *path;
+
+    if (decoder->hole) {
+        g_printerr ("Replay needs the texture mode.\n");
+        g_free (name);
+        return NULL;
+    }
+    if (max_speed)
+        name[strlen (name) - strlen (REPLAY_URI_MAX_SPEED)] = '\0';
+    path = cache_path (name);
+    decoder->replay = path ? FrameCapture_openReader (path) : NULL;
+    if (!decoder->replay) {
+        g_printerr ("Unable to open the capture %s.\n", name);
+        g_free (name);
+        g_free (path);
+        return NULL;
+    }
+    g_free (name);
+    g_free (path);
+
+    pipeline = gst_pipeline_new ("replay");
+    source = gst_element_factory_make ("appsrc", "replaysrc");
+    decoder->sink = gst_element_factory_make ("fakesink", "vsink");
+    sink = decoder->sink;
+    if (!source || !sink) {
+        g_printerr ("Unable to create the replay elements.\n");
+        if (source)
+            gst_object_unref (source);
+        if (sink)
+            gst_object_unref (sink);
+        gst_object_unref (pipeline);
+        decoder->sink = NULL;
+        FrameCapture_close (decoder->replay);
+        decoder->replay = NULL;
+        return NULL;
+    }
+
+    g_object_set (source, "format", GST_FORMAT_TIME, NULL);
+    g_signal_connect (source, "need-data", G_CALLBACK (replay_need_data), decoder);
+    /* at maximum speed frames are handed over as fast as they are read */
+    g_object_set (sink,
+          "sync", !max_speed,
+          "silent", TRUE,
+          "enable-last-sample", FALSE,
+          "signal-handoffs", TRUE, NULL);
+    g_signal_connect (sink, "preroll-handoff", G_CALLBACK (buffers_cb), (void*)decoder);
+    g_signal_connect (sink, "handoff", G_CALLBACK (buffers_cb), (void*)decoder);
+
+    gst_bin_add_many (GST_BIN (pipeline), source, sink, NULL);
+    gst_element_link (source, sink);
+    decoder->replay_frames = 0;
+    decoder->replay_start = 0;
+    return pipeline;
+}
+
+/* Called at display time of every rendered subtitle */
+static void
+overlay_cb (GstElement * fakesink, GstBuffer * buffer, GstPad * pad,
+        gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    GstEvent *event = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+    GstClockTime expiry = GST_CLOCK_TIME_NONE;
+
+    if (event && GST_BUFFER_PTS_IS_VALID (buffer) &&
+        GST_BUFFER_DURATION_IS_VALID (buffer)) {
+        const GstSegment *segment;
+        gst_event_parse_segment (event, &segment);
+        expiry = gst_segment_to_running_time (segment, GST_FORMAT_TIME,
+                GST_BUFFER_PTS (buffer) + GST_BUFFER_DURATION (buffer));
+    }
+    if (event)
+        gst_event_unref (event);
+
+    g_mutex_lock (&decoder->overlay_lock);
+    gst_buffer_replace (&decoder->overlay, buffer);
+    decoder->overlay_shown = true;
+    decoder->overlay_expiry = expiry;
+    g_mutex_unlock (&decoder->overlay_lock);
+}
+
+/* With overlay_lock held */
+static GstClockTime overlay_running_time_unlocked (VideoDecoderGstreamer *decoder)
+{
+    if (GST_CLOCK_TIME_IS_VALID (decoder->overlay_paused_at))
+        return decoder->overlay_paused_at;
+    if (!decoder->overlay_clock)
+        return GST_CLOCK_TIME_NONE;
+    return gst_clock_get_time (decoder->overlay_clock) - decoder->overlay_base_time;
+}
+
+/* Follows the state of playbin from the bus watch: the running time goes
+ * on from the clock while playing and stays where it was otherwise. */
+static void overlay_state_changed (VideoDecoderGstreamer *decoder,
+        GstState state)
+{
+    if (decoder->subtitles != VIDEO_DECODER_SUBTITLES_GPU)
+        return;
+    g_mutex_lock (&decoder->overlay_lock);
+    if (state == GST_STATE_PLAYING) {
+        if (decoder->overlay_clock)
+            gst_object_unref (decoder->overlay_clock);
+        decoder->overlay_clock = gst_element_get_clock (decoder->playbin);
+        decoder->overlay_base_time = gst_element_get_base_time (decoder->playbin);
+        decoder->overlay_paused_at = GST_CLOCK_TIME_NONE;
+    } else if (!GST_CLOCK_TIME_IS_VALID (decoder->overlay_paused_at)) {
+        decoder->overlay_paused_at = overlay_running_time_unlocked (decoder);
+    }
+    g_mutex_unlock (&decoder->overlay_lock);
+}
+
+static void overlay_clear (VideoDecoderGstreamer *decoder)
+{
+    g_mutex_lock (&decoder->overlay_lock);
+    gst_buffer_replace (&decoder->overlay, NULL);
+    decoder->overlay_shown = false;
+    decoder->overlay_expiry = GST_CLOCK_TIME_NONE;
+    if (decoder->overlay_clock)
+        gst_object_unref (decoder->overlay_clock);
+    decoder->overlay_clock = NULL;
+    decoder->overlay_paused_at = GST_CLOCK_TIME_NONE;
+    g_mutex_unlock (&decoder->overlay_lock);
+}
+
+/* text-sink for playbin: subtitles are rasterized by textrender into a
+ * transparent RGBA frame, only when they change, instead of being blended
+ * by playbin into every video frame. */
+static GstElement *overlay_sink_new (VideoDecoderGstreamer *decoder)
+{
+    GstElement *bin, *render, *conv, *sink;
+    GstPad *pad;
+    GstCaps *caps;
+
+    render = gst_element_factory_make ("textrender", "overlayrender");
+    conv = gst_element_factory_make ("videoconvert", "overlayconv");
+    sink = gst_element_factory_make ("fakesink", "overlaysink");
+    if (!render || !conv || !sink) {
+        g_printerr ("Unable to create the subtitle overlay elements.\n");
+        if (render)
+            gst_object_unref (render);
+        if (conv)
+            gst_object_unref (conv);
+        if (sink)
+            gst_object_unref (sink);
+        return NULL;
+    }
+
+    g_object_set (sink,
+          "sync", TRUE,
+          "silent", TRUE,
+          "enable-last-sample", FALSE,
+          "signal-handoffs", TRUE, NULL);
+    g_signal_connect (sink, "handoff", G_CALLBACK (overlay_cb), (void*)decoder);
+
+    caps = gst_caps_new_simple ("video/x-raw",
+                        "format", G_TYPE_STRING, "RGBA",
+                        "width", G_TYPE_INT, decoder->frame_width,
+                        "height", G_TYPE_INT, decoder->frame_height,
+                        NULL);
+    bin = gst_bin_new ("overlaybin");
+    gst_bin_add_many (GST_BIN (bin), render, conv, sink, NULL);
+    gst_element_link (render, conv);
+    gst_element_link_filtered (conv, sink, caps);
+    gst_caps_unref (caps);
+
+    pad = gst_element_get_static_pad (render, "sink");
+    gst_element_add_pad (bin, gst_ghost_pad_new ("sink", pad));
+    gst_object_unref (pad);
+    return bin;
+}
+
+/* Queues the PCM for the device, together with the time its first byte is
+ * due, computed from its running time and the pipeline clock. Whatever
+ * does not fit is dropped. */
+static void
+audio_cb (GstElement * fakesink, GstBuffer * buffer, GstPad * pad,
+        gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    guint frame = decoder->audio_channels * 2;
+    GstMapInfo mapinfo = { 0, };
+    GstEvent *event;
+    GstClock *clock;
+    guint32 size;
+
+    event = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+    clock = gst_element_get_clock (fakesink);
+    if (event && clock && GST_BUFFER_PTS_IS_VALID (buffer)) {
+        const GstSegment *segment;
+        guint64 running;
+
+        gst_event_parse_segment (event, &segment);
+        running = gst_segment_to_running_time (segment, GST_FORMAT_TIME,
+                GST_BUFFER_PTS (buffer));
+        if (running != GST_CLOCK_TIME_NONE) {
+            GstClockTimeDiff ahead = GST_CLOCK_DIFF (gst_clock_get_time (clock),
+                    gst_element_get_base_time (fakesink) + running);
+            g_atomic_int_inc (&decoder->audio_due_seq);
+            decoder->audio_due_us = g_get_monotonic_time () + ahead / 1000;
+            decoder->audio_due_position =
+                    AudioRing_writePosition (decoder->audio_ring);
+            g_atomic_int_inc (&decoder->audio_due_seq);
+        }
+    }
+    if (event)
+        gst_event_unref (event);
+    if (clock)
+        gst_object_unref (clock);
+
+    if (!gst_buffer_map (buffer, &mapinfo, GST_MAP_READ))
+        return;
+    /* whole frames only, so that channels stay in place */
+    size = MIN (mapinfo.size, AudioRing_size (decoder->audio_ring) -
+            AudioRing_fill (decoder->audio_ring));
+    size -= size % frame;
+    AudioRing_write (decoder->audio_ring, mapinfo.data, size);
+    if (size < mapinfo.size)
+        g_atomic_int_inc (&decoder->audio_overruns);
+    gst_buffer_unmap (buffer, &mapinfo);
+}
+
+/* audio-sink for playbin: interleaved S16LE at the device rate into
+ * audio_cb. The sink is synchronized against the clock ts-offset ahead of
+ * it, by the latency the device adds, see audio_tick. */
+static GstElement *audio_sink_new (VideoDecoderGstreamer *decoder)
+{
+    GstElement *bin, *conv, *resample, *sink;
+    GstPad *pad;
+    GstCaps *caps;
+
+    conv = gst_element_factory_make ("audioconvert", "audioconv");
+    resample = gst_element_factory_make ("audioresample", "audioresample");
+    sink = gst_element_factory_make ("fakesink", "asink");
+    if (!conv || !resample || !sink) {
+        g_printerr ("Unable to create the audio output elements.\n");
+        if (conv)
+            gst_object_unref (conv);
+        if (resample)
+            gst_object_unref (resample);
+        if (sink)
+            gst_object_unref (sink);
+        return NULL;
+    }
+
+    g_object_set (sink,
+          "sync", TRUE,
+          "silent", TRUE,
+          "enable-last-sample", FALSE,
+          "ts-offset", (gint64) -decoder->audio_latency_us * 1000,
+          "signal-handoffs", TRUE, NULL);
+    g_signal_connect (sink, "handoff", G_CALLBACK (audio_cb), (void*)decoder);
+
+    caps = gst_caps_new_simple ("audio/x-raw",
+                        "format", G_TYPE_STRING, "S16LE",
+                        "layout", G_TYPE_STRING, "interleaved",
+                        "rate", G_TYPE_INT, decoder->audio_rate,
+                        "channels", G_TYPE_INT, decoder->audio_channels,
+                        NULL);
+    bin = gst_bin_new ("audiobin");
+    gst_bin_add_many (GST_BIN (bin), conv, resample, sink, NULL);
+    gst_element_link (conv, resample);
+    gst_element_link_filtered (resample, sink, caps);
+    gst_caps_unref (caps);
+
+    pad = gst_element_get_static_pad (conv, "sink");
+    gst_element_add_pad (bin, gst_ghost_pad_new ("sink", pad));
+    gst_object_unref (pad);
+    decoder->audio_sink = sink;
+    return bin;
+}
+
+/* Pushes what the ring holds past the read position to appsrc, as long as
+ * appsrc wants data. Called by the recorder after each write and by
+ * appsrc when it runs low. */
+static void timeshift_feed (VideoDecoderGstreamer *decoder)
+{
+    g_mutex_lock (&decoder->timeshift_lock);
+    while (decoder->appsrc && g_atomic_int_get (&decoder->timeshift_want)) {
+        GstBuffer *buffer;
+        GstMapInfo mapinfo = { 0, };
+        GstFlowReturn ret;
+        guint32 count;
+
+        /* the recorder overwrote what was not played yet */
+        if (decoder->timeshift_read < TimeshiftRing_tail (decoder->timeshift_ring) &&
+            !TimeshiftRing_seekPoint (decoder->timeshift_ring, 0,
+                    &decoder->timeshift_read))
+            decoder->timeshift_read = TimeshiftRing_tail (decoder->timeshift_ring);
+
+        buffer = gst_buffer_new_allocate (NULL, TIMESHIFT_CHUNK, NULL);
+        gst_buffer_map (buffer, &mapinfo, GST_MAP_WRITE);
+        count = TimeshiftRing_read (decoder->timeshift_ring,
+                decoder->timeshift_read, mapinfo.data, TIMESHIFT_CHUNK);
+        gst_buffer_unmap (buffer, &mapinfo);
+        if (count == 0) {
+            /* caught up with live, or with the end of a finished recording */
+            gst_buffer_unref (buffer);
+            if (decoder->timeshift_ended)
+                g_signal_emit_by_name (decoder->appsrc, "end-of-stream", &ret);
+            break;
+        }
+        gst_buffer_set_size (buffer, count);
+        decoder->timeshift_read += count;
+        g_signal_emit_by_name (decoder->appsrc, "push-buffer", buffer, &ret);
+        gst_buffer_unref (buffer);
+    }
+    g_mutex_unlock (&decoder->timeshift_lock);
+}
+
+static void
+recorder_cb (GstElement * fakesink, GstBuffer * buffer, GstPad * pad,
+        gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    GstMapInfo mapinfo = { 0, };
+
+    if (!gst_buffer_map (buffer, &mapinfo, GST_MAP_READ))
+        return;
+    TimeshiftRing_write (decoder->timeshift_ring, mapinfo.data, mapinfo.size,
+            g_get_monotonic_time ());
+    gst_buffer_unmap (buffer, &mapinfo);
+    timeshift_feed (decoder);
+}
+
+static void timeshift_need_data (GstElement *appsrc, guint length,
+        gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    g_atomic_int_set (&decoder->timeshift_want, 1);
+    timeshift_feed (decoder);
+}
+
+static void timeshift_enough_data (GstElement *appsrc, gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    g_atomic_int_set (&decoder->timeshift_want, 0);
+}
+
+/* playbin creates a new appsrc each time it leaves READY */
+static void timeshift_source_setup (GstElement *playbin, GstElement *source,
+        gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+
+    g_object_set (source,
+            "stream-type", 0, /* GST_APP_STREAM_TYPE_STREAM */
+            "format", GST_FORMAT_BYTES,
+            "max-bytes", (guint64) 4 * TIMESHIFT_CHUNK,
+            NULL);
+    g_signal_connect (source, "need-data", G_CALLBACK (timeshift_need_data), decoder);
+    g_signal_connect (source, "enough-data", G_CALLBACK (timeshift_enough_data), decoder);
+
+    g_mutex_lock (&decoder->timeshift_lock);
+    if (decoder->appsrc)
+        gst_object_unref (decoder->appsrc);
+    decoder->appsrc = (GstElement *) gst_object_ref (source);
+    g_atomic_int_set (&decoder->timeshift_want, 0);
+    g_mutex_unlock (&decoder->timeshift_lock);
+}
+
+/* An error of the recorder stops the player like one of playbin does.
+ * At the end of the recorded source playbin plays what the ring holds,
+ * then gets end-of-stream from appsrc. */
+static gboolean recorder_handle_message (GstBus *bus, GstMessage *msg,
+        gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+
+    switch (GST_MESSAGE_TYPE (msg)) {
+    case GST_MESSAGE_ERROR: {
+      GError *err;
+      gchar *debug;
+
+      gst_message_parse_error (msg, &err, &debug);
+      g_print ("recorder_handle_message:ERROR: %s\n", err->message);
+      g_error_free (err);
+      g_free (debug);
+
+      gst_element_set_state (decoder->recorder, GST_STATE_NULL);
+      if (decoder->playbin)
+        gst_element_set_state (decoder->playbin, GST_STATE_READY);
+      decoder->stop = true;
+      break;
+    }
+    case GST_MESSAGE_EOS:
+      g_print ("recorder_handle_message:EOS\n");
+      g_mutex_lock (&decoder->timeshift_lock);
+      decoder->timeshift_ended = true;
+      g_mutex_unlock (&decoder->timeshift_lock);
+      timeshift_feed (decoder);
+      break;
+    default:
+      break;
+    }
+    return true;
+}
+
+/* The source runs in its own pipeline so that it keeps recording while
+ * playbin is paused or replaying. */
+static bool timeshift_start (VideoDecoderGstreamer *decoder, const char *url)
+{
+    GstElement *source, *sink;
+    GstBus *bus;
+
+    decoder->timeshift_ring = TimeshiftRing_open (decoder->timeshift_path,
+            decoder->timeshift_size);
+    if (!decoder->timeshift_ring) {
+        g_printerr ("Unable to map the timeshift ring %s.\n", decoder->timeshift_path);
+        return false;
+    }
+
+    source = gst_element_make_from_uri (GST_URI_SRC, url, "tssource", NULL);
+    sink = gst_element_factory_make ("fakesink", "tsrecorder");
+    if (!source || !sink) {
+        g_printerr ("Unable to create the timeshift recorder.\n");
+        if (source)
+            gst_object_unref (source);
+        if (sink)
+            gst_object_unref (sink);
+        TimeshiftRing_close (decoder->timeshift_ring);
+        decoder->timeshift_ring = NULL;
+        return false;
+    }
+    g_object_set (sink,
+          "sync", FALSE,
+          "silent", TRUE,
+          "enable-last-sample", FALSE,
+          "signal-handoffs", TRUE, NULL);
+    g_signal_connect (sink, "handoff", G_CALLBACK (recorder_cb), (void*)decoder);
+
+    decoder->recorder = gst_pipeline_new ("recorder");
+    gst_bin_add_many (GST_BIN (decoder->recorder), source, sink, NULL);
+    gst_element_link (source, sink);
+    bus = gst_pipeline_get_bus (GST_PIPELINE (decoder->recorder));
+    decoder->recorder_watch = decoder_attach (decoder,
+            gst_bus_create_watch (bus), (GSourceFunc) recorder_handle_message);
+    gst_object_unref (bus);
+
+    decoder->timeshift_read = 0;
+    decoder->timeshift_ended = false;
+    g_object_set (decoder->playbin, "uri", "appsrc://", NULL);
+    g_signal_connect (decoder->playbin, "source-setup",
+            G_CALLBACK (timeshift_source_setup), decoder);
+
+    gst_element_set_state (decoder->recorder, GST_STATE_PLAYING);
+    return true;
+}
+
+static void timeshift_stop (VideoDecoderGstreamer *decoder)
+{
+    decoder_detach (&decoder->recorder_watch);
+    if (decoder->recorder) {
+        gst_element_set_state (decoder->recorder, GST_STATE_NULL);
+        gst_object_unref (decoder->recorder);
+        decoder->recorder = NULL;
+    }
+    g_mutex_lock (&decoder->timeshift_lock);
+    if (decoder->appsrc) {
+        gst_object_unref (decoder->appsrc);
+        decoder->appsrc = NULL;
+    }
+    g_mutex_unlock (&decoder->timeshift_lock);
+    if (decoder->timeshift_ring) {
+        TimeshiftRing_close (decoder->timeshift_ring);
+        decoder->timeshift_ring = NULL;
+    }
+}
+
+/* Restarting playbin from READY flushes what appsrc and the decoders hold,
+ * then it pulls again from the new read position. */
+static int32_t command_timeshift (VideoDecoderGstreamer *decoder,
+        DecoderCommand *cmd)
+{
+    gint64 start = g_get_monotonic_time ();
+    guint64 offset;
+
+    if (!decoder->initialized || !decoder->timeshift_ring)
+        return PP_ERROR_FAILED;
+    if (!TimeshiftRing_seekPoint (decoder->timeshift_ring,
+                start - cmd->from_ms * 1000, &offset))
+        return PP_ERROR_FAILED;
+
+    gst_element_set_state (decoder->playbin, GST_STATE_READY);
+    g_mutex_lock (&decoder->timeshift_lock);
+    decoder->timeshift_read = offset;
+    g_mutex_unlock (&decoder->timeshift_lock);
+    decoder->timeshift_seek_start = start;
+    if (GST_STATE_CHANGE_FAILURE ==
+            gst_element_set_state (decoder->playbin, GST_STATE_PLAYING))
+        return PP_ERROR_FAILED;
+    decoder->playing = true;
+    return PP_OK;
+}
+
+/* Sets an unsigned property the element may not have, clamped to its range */
+static void abr_set_property (GstElement *element, const char *name,
+        guint64 value)
+{
+    GParamSpec *pspec =
+            g_object_class_find_property (G_OBJECT_GET_CLASS (element), name);
+
+    if (!pspec)
+        return;
+    if (pspec->value_type == G_TYPE_UINT)
+        g_object_set (element, name,
+                (guint) MIN (value, G_PARAM_SPEC_UINT (pspec)->maximum), NULL);
+    else if (pspec->value_type == G_TYPE_UINT64)
+        g_object_set (element, name,
+                MIN (value, G_PARAM_SPEC_UINT64 (pspec)->maximum), NULL);
+    else if (pspec->value_type == G_TYPE_INT)
+        g_object_set (element, name,
+                (gint) MIN (value, (guint64) G_PARAM_SPEC_INT (pspec)->maximum), NULL);
+}
+
+/* hlsdemux picks variants within connection-speed, dashdemux within
+ * max-bitrate and, when it has them, max-video-width/height. Playbin
+ * passes connection-speed on to the demuxers it creates next. */
+static void abr_apply (VideoDecoderGstreamer *decoder)
+{
+    AbrDecision *decision = &decoder->abr_decision;
+    guint64 kbps = decision->max_bitrate / 1000;
+
+    if (!decoder->abr_decided)
+        return;
+    if (decoder->playbin)
+        abr_set_property (decoder->playbin, "connection-speed", kbps);
+    if (!decoder->abr_demux)
+        return;
+    abr_set_property (decoder->abr_demux, "connection-speed", kbps);
+    abr_set_property (decoder->abr_demux, "max-bitrate", decision->max_bitrate);
+    abr_set_property (decoder->abr_demux, "max-video-width", decision->max_width);
+    abr_set_property (decoder->abr_demux, "max-video-height", decision->max_height);
+}
+
+static void abr_find_demux (VideoDecoderGstreamer *decoder, GstObject *object)
+{
+    static const char *demuxers[] = { "hlsdemux", "dashdemux", "mssdemux" };
+    GstElementFactory *factory;
+    const gchar *name;
+    guint i;
+
+    if (!GST_IS_ELEMENT (object) ||
+        !(factory = gst_element_get_factory (GST_ELEMENT (object))))
+        return;
+    name = gst_plugin_feature_get_name (GST_PLUGIN_FEATURE (factory));
+    for (i = 0; i < G_N_ELEMENTS (demuxers); i++) {
+        if (strcmp (name, demuxers[i]) == 0) {
+            g_print ("---VideoDecoderGstreamer::abr controls %s\n", name);
+            decoder->abr_demux = (GstElement *) gst_object_ref (object);
+            abr_apply (decoder);
+            return;
+        }
+    }
+}
+
+/* The caps only bound the choice: the variant actually played shows in
+ * the decoded video caps, and for HLS in the "playlist" message. */
+static void abr_check_variant (VideoDecoderGstreamer *decoder)
+{
+    GstPad *pad = NULL;
+    GstCaps *caps;
+    gint width = 0, height = 0;
+
+    g_signal_emit_by_name (decoder->playbin, "get-video-pad", 0, &pad);
+    if (!pad)
+        return;
+    if ((caps = gst_pad_get_current_caps (pad))) {
+        GstStructure *s = gst_caps_get_structure (caps, 0);
+        if (gst_structure_get_int (s, "width", &width) &&
+            gst_structure_get_int (s, "height", &height) &&
+            (width != decoder->abr_variant_width ||
+             height != decoder->abr_variant_height)) {
+            decoder->abr_variant_width = width;
+            decoder->abr_variant_height = height;
+            decoder->abr_variant_changed = true;
+        }
+        gst_caps_unref (caps);
+    }
+    gst_object_unref (pad);
+}
+
+static gboolean abr_tick (gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    VideoDecoderAbrEvent event;
+    AbrSample sample;
+    GstQuery *query;
+    bool capped;
+
+    if (!decoder->playbin || !decoder->playing || decoder->parked)
+        return TRUE;
+
+    memset (&sample, 0, sizeof (sample));
+    sample.bandwidth = decoder->abr_fragment_bandwidth;
+    sample.buffer_percent = -1;
+    decoder->abr_fragment_bandwidth = 0;
+
+    /* queue2 measures the download rate of non-fragmented streams */
+    query = gst_query_new_buffering (GST_FORMAT_TIME);
+    if (gst_element_query (decoder->playbin, query)) {
+        gint percent, avg_in;
+        gst_query_parse_buffering_percent (query, NULL, &percent);
+        gst_query_parse_buffering_stats (query, NULL, &avg_in, NULL, NULL);
+        sample.buffer_percent = percent;
+        if (!sample.bandwidth && avg_in > 0)
+            sample.bandwidth = (guint64) avg_in * 8;
+    }
+    gst_query_unref (query);
+
+    if (decoder->qos_processed >= decoder->abr_processed &&
+        decoder->qos_dropped >= decoder->abr_dropped) {
+        sample.processed = decoder->qos_processed - decoder->abr_processed;
+        sample.dropped = decoder->qos_dropped - decoder->abr_dropped;
+    }
+    decoder->abr_processed = decoder->qos_processed;
+    decoder->abr_dropped = decoder->qos_dropped;
+
+    capped = AbrController_update (decoder->abr, &sample, &decoder->abr_decision);
+    if (capped) {
+        decoder->abr_decided = true;
+        abr_apply (decoder);
+    }
+    abr_check_variant (decoder);
+    if (!capped && !decoder->abr_variant_changed)
+        return TRUE;
+    decoder->abr_variant_changed = false;
+
+    event.max_bitrate = decoder->abr_decision.max_bitrate;
+    event.max_width = decoder->abr_decision.max_width;
+    event.max_height = decoder->abr_decision.max_height;
+    event.bandwidth = decoder->abr_decision.bandwidth;
+    event.buffer_percent = sample.buffer_percent;
+    event.reason = capped ? decoder->abr_decision.reason : "variant";
+    event.variant_bitrate = decoder->abr_variant_bitrate;
+    event.variant_width = decoder->abr_variant_width;
+    event.variant_height = decoder->abr_variant_height;
+    g_print ("--[STATS] abr: cap %" G_GUINT64_FORMAT " kbps %dx%d, bandwidth %"
+            G_GUINT64_FORMAT " kbps, buffer %d%%, %s, playing %" G_GUINT64_FORMAT
+            " kbps %dx%d\n",
+            event.max_bitrate / 1000, event.max_width, event.max_height,
+            event.bandwidth / 1000, event.buffer_percent, event.reason,
+            event.variant_bitrate / 1000, event.variant_width,
+            event.variant_height);
+    if (decoder->abr_switch)
+        decoder->abr_switch (decoder->abr_user_data, &event);
+    return TRUE;
+}
+
+/* Reports the device latency plus two callback periods (what the ring
+ * must hold for the device never to wait) to the sink, which then hands
+ * the audio over that much ahead of the clock. */
+static gboolean audio_tick (gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    gint64 device_us = g_atomic_int_get (&decoder->audio_device_us);
+    gint64 period_us = g_atomic_int_get (&decoder->audio_period_us);
+    gint64 bytes_per_sec = decoder->audio_rate * decoder->audio_channels * 2;
+    gint64 ring_us = (gint64) AudioRing_size (decoder->audio_ring) *
+            G_USEC_PER_SEC / bytes_per_sec;
+    gint64 fill_us = (gint64) AudioRing_fill (decoder->audio_ring) *
+            G_USEC_PER_SEC / bytes_per_sec;
+    gint64 latency_us;
+
+    if (!decoder->playbin || !decoder->playing || decoder->parked ||
+        !period_us)
+        return TRUE;
+
+    latency_us = MAX (0, MIN (device_us + 2 * period_us, ring_us - period_us));
+    if (ABS (latency_us - decoder->audio_latency_us) >= AUDIO_LATENCY_STEP_US) {
+        decoder->audio_latency_us = latency_us;
+        g_object_set (decoder->audio_sink, "ts-offset",
+                (gint64) -latency_us * 1000, NULL);
+    }
+
+    if (++decoder->audio_ticks % AUDIO_STATS_TICKS)
+        return TRUE;
+    g_print ("--[STATS] audio: latency %.1f ms (device %.1f ms, ring %.1f ms), "
+            "a/v offset %+.1f ms, resyncs %d, underruns %d, overruns %d\n",
+            (device_us + fill_us) / 1000.0, device_us / 1000.0,
+            fill_us / 1000.0,
+            g_atomic_int_get (&decoder->audio_offset_us) / 1000.0,
+            g_atomic_int_get (&decoder->audio_resyncs),
+            g_atomic_int_get (&decoder->audio_underruns),
+            g_atomic_int_get (&decoder->audio_overruns));
+    return TRUE;
+}
+
+/* Sums what the queues of the pipeline hold right now: queue2 buffering
+ * the network and the queues of the decodebins. */
+static gboolean memory_tick (gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    GValue item = G_VALUE_INIT;
+    GstIterator *iterator;
+    guint64 bytes = 0;
+    bool done = false;
+
+    if (!decoder->playbin)
+        return TRUE;
+    iterator = gst_bin_iterate_recurse (GST_BIN (decoder->playbin));
+    while (!done) {
+        switch (gst_iterator_next (iterator, &item)) {
+        case GST_ITERATOR_OK: {
+            GObject *element = (GObject *) g_value_get_object (&item);
+            GParamSpec *pspec = g_object_class_find_property (
+                    G_OBJECT_GET_CLASS (element), "current-level-bytes");
+            guint level = 0;
+            if (pspec && pspec->value_type == G_TYPE_UINT) {
+                g_object_get (element, "current-level-bytes", &level, NULL);
+                bytes += level;
+            }
+            g_value_reset (&item);
+            break;
+        }
+        case GST_ITERATOR_RESYNC:
+            gst_iterator_resync (iterator);
+            bytes = 0;
+            break;
+        default:
+            done = true;
+            break;
+        }
+    }
+    g_value_unset (&item);
+    gst_iterator_free (iterator);
+    g_atomic_int_set (&decoder->pipeline_bytes, (gint) MIN (bytes, (guint64) G_MAXINT));
+    return TRUE;
+}
+
 static gboolean gstPlayer_handle_message (GstBus *bus, GstMessage *msg, gpointer user_data)
 {
   VideoDecoderGstreamer *data = (VideoDecoderGstreamer *)user_data;
 
+  if (!data->playbin)
+    return true;
+
   g_print("gstPlayer_handle_message msg=%d,%s \n",
                   GST_MESSAGE_TYPE(msg),
                   GST_MESSAGE_TYPE_NAME(msg));
@@ -84,6 +1146,12 @@ static gboolean gstPlayer_handle_message (GstBus *bus, GstMessage *msg, gpointer
     case GST_MESSAGE_EOS:
       /* end-of-stream */
       g_print("handle_message:EOS\n");
+      if (data->replay && data->replay_start) {
+        gint64 elapsed = g_get_monotonic_time () - data->replay_start;
+        g_print ("--[STATS] replay: %d frames in %.1f ms, %.1f fps\n",
+            data->replay_frames, elapsed / 1000.0,
+            elapsed ? data->replay_frames * 1e6 / elapsed : 0.0);
+      }
       gst_element_set_state (data->playbin, GST_STATE_READY);
       data->stop=true;
       break;
@@ -92,6 +1160,8 @@ static gboolean gstPlayer_handle_message (GstBus *bus, GstMessage *msg, gpointer
 
       /* If the stream is live, we do not care about buffering. */
       if (data->playing) break;
+      /* A parked player stays where it was put. */
+      if (data->parked) break;
 
       gst_message_parse_buffering (msg, &percent);
       g_print("handle_message:BUFFERING(%3d%%)\n", percent);
@@ -115,8 +1185,47 @@ static gboolean gstPlayer_handle_message (GstBus *bus, GstMessage *msg, gpointer
         g_print("handle_message:STATE_CHANGED %s to %s:\n",
             gst_element_state_get_name (old_state), gst_element_state_get_name (new_state));
         data->playing = (new_state == GST_STATE_PLAYING);
+        overlay_state_changed (data, new_state);
+        if (data->playing && data->timeshift_seek_start) {
+          g_print ("--[STATS] timeshift: replay started after %.1f ms\n",
+              (g_get_monotonic_time () - data->timeshift_seek_start) / 1000.0);
+          data->timeshift_seek_start = 0;
+        }
+      } else if (data->abr && !data->abr_demux) {
+        abr_find_demux (data, GST_MESSAGE_SRC (msg));
       }
       break;
+    case GST_MESSAGE_QOS:
+      if (data->sink && GST_MESSAGE_SRC (msg) == GST_OBJECT (data->sink)) {
+        GstFormat format;
+        guint64 processed, dropped;
+        gst_message_parse_qos_stats (msg, &format, &processed, &dropped);
+        if (format == GST_FORMAT_BUFFERS) {
+          data->qos_processed = processed;
+          data->qos_dropped = dropped;
+        }
+      }
+      break;
+    case GST_MESSAGE_ELEMENT: {
+      /* posted by the adaptive demuxers for every fragment, and by
+       * hlsdemux when it switches to another variant playlist */
+      const GstStructure *s = gst_message_get_structure (msg);
+      guint64 size, download_time;
+      gint bitrate;
+      if (data->abr && s && gst_structure_has_name (s, "playlist") &&
+          gst_structure_get_int (s, "bitrate", &bitrate) && bitrate > 0 &&
+          (guint64) bitrate != data->abr_variant_bitrate) {
+        data->abr_variant_bitrate = bitrate;
+        data->abr_variant_changed = true;
+      } else if (data->abr && s &&
+          gst_structure_has_name (s, "adaptive-streaming-statistics") &&
+          gst_structure_get_uint64 (s, "fragment-size", &size) &&
+          gst_structure_get_uint64 (s, "fragment-download-time", &download_time) &&
+          download_time > 0)
+        data->abr_fragment_bandwidth =
+            gst_util_uint64_scale (size * 8, GST_SECOND, download_time);
+      break;
+    }
     default:
       /* Unhandled message */
       break;
@@ -125,8 +1234,234 @@ static gboolean gstPlayer_handle_message (GstBus *bus, GstMessage *msg, gpointer
     return true;
 }
 
+static void command_free (DecoderCommand *cmd)
+{
+    g_free (cmd->arg);
+    g_free (cmd);
+}
+
+static void command_notify (VideoDecoderGstreamer *decoder,
+        VideoDecoderCommand command, int32_t result)
+{
+    g_print("---VideoDecoderGstreamer::command %s done %d\n",
+            VideoDecoderGstreamer_commandName (command), result);
+    if (decoder->command_done)
+        decoder->command_done (decoder->command_user_data, command, result);
+}
+
+/* Parking keeps the position so that a READY pipeline can come back to
+ * it; PAUSED keeps everything prerolled for the fastest resume. */
+static int32_t command_park (VideoDecoderGstreamer *decoder)
+{
+    GstState state = decoder->park_to_ready ? GST_STATE_READY : GST_STATE_PAUSED;
+
+    if (!decoder->initialized || decoder->parked)
+        return PP_ERROR_FAILED;
+    decoder->park_resume_playing = decoder->playing;
+    decoder->park_position = -1;
+    gst_element_query_position (decoder->playbin, GST_FORMAT_TIME,
+            &decoder->park_position);
+    g_print("---VideoDecoderGstreamer::park in %s at %" GST_TIME_FORMAT "\n",
+            gst_element_state_get_name (state),
+            GST_TIME_ARGS (decoder->park_position));
+    if (GST_STATE_CHANGE_FAILURE == gst_element_set_state (decoder->playbin, state))
+        return PP_ERROR_FAILED;
+    decoder->playing = false;
+    decoder->parked = true;
+    return PP_OK;
+}
+
+static int32_t command_unpark (VideoDecoderGstreamer *decoder)
+{
+    if (!decoder->initialized || !decoder->parked)
+        return PP_ERROR_FAILED;
+    decoder->parked = false;
+
+    if (decoder->park_to_ready) {
+        gst_element_set_state (decoder->playbin, GST_STATE_PAUSED);
+        if (GST_STATE_CHANGE_FAILURE == gst_element_get_state (decoder->playbin,
+                    NULL, NULL, 5 * GST_SECOND))
+            return PP_ERROR_FAILED;
+        if (decoder->park_position > 0)
+            gst_element_seek_simple (decoder->playbin, GST_FORMAT_TIME,
+                    (GstSeekFlags) (GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT),
+                    decoder->park_position);
+    }
+    if (!decoder->park_resume_playing)
+        return PP_OK;
+    if (GST_STATE_CHANGE_FAILURE ==
+            gst_element_set_state (decoder->playbin, GST_STATE_PLAYING))
+        return PP_ERROR_FAILED;
+    decoder->playing = true;
+    return PP_OK;
+}
+
+/* The playbin flags without video are kept until the video comes back */
+static int32_t command_skip_video (VideoDecoderGstreamer *decoder, bool skip)
+{
+    guint flags;
+
+    if (!decoder->initialized || decoder->replay)
+        return PP_ERROR_FAILED;
+    if (skip && !decoder->hidden_flags) {
+        g_object_get (decoder->playbin, "flags", &flags, NULL);
+        decoder->hidden_flags = flags;
+        g_object_set (decoder->playbin, "flags",
+                flags & ~(GST_PLAY_FLAG_VIDEO | GST_PLAY_FLAG_NATIVE_VIDEO), NULL);
+    } else if (!skip && decoder->hidden_flags) {
+        g_object_set (decoder->playbin, "flags", decoder->hidden_flags, NULL);
+        decoder->hidden_flags = 0;
+    }
+    return PP_OK;
+}
 
+static int32_t command_restart (VideoDecoderGstreamer *decoder)
+{
+    gchar *url;
+    int32_t result = PP_ERROR_FAILED;
+
+    g_mutex_lock (&decoder->command_lock);
+    url = g_strdup (decoder->url);
+    g_mutex_unlock (&decoder->command_lock);
+    if (url) {
+        VideoDecoderGstreamer_release (decoder);
+        result = VideoDecoderGstreamer_initialize (decoder, url);
+        g_free (url);
+    }
+    return result;
+}
 
+static int32_t command_run (VideoDecoderGstreamer *decoder, DecoderCommand *cmd)
+{
+    switch (cmd->command) {
+    case VIDEO_DECODER_CMD_INITIALIZE:
+        return VideoDecoderGstreamer_initialize (decoder, cmd->arg);
+    case VIDEO_DECODER_CMD_PLAY:
+        return VideoDecoderGstreamer_play (decoder);
+    case VIDEO_DECODER_CMD_PAUSE:
+        return VideoDecoderGstreamer_pause (decoder);
+    case VIDEO_DECODER_CMD_PLAY_PAUSE:
+        if (VideoDecoderGstreamer_isPlaying (decoder))
+            return VideoDecoderGstreamer_pause (decoder);
+        if ((!decoder->initialized || decoder->stop) &&
+            PP_OK != command_restart (decoder))
+            return PP_ERROR_FAILED;
+        return VideoDecoderGstreamer_play (decoder);
+    case VIDEO_DECODER_CMD_RELEASE:
+        VideoDecoderGstreamer_release (decoder);
+        return PP_OK;
+    case VIDEO_DECODER_CMD_PARK:
+        return command_park (decoder);
+    case VIDEO_DECODER_CMD_UNPARK:
+        return command_unpark (decoder);
+    case VIDEO_DECODER_CMD_TIMESHIFT:
+        return command_timeshift (decoder, cmd);
+    case VIDEO_DECODER_CMD_TIMESHIFT_EXPORT: {
+        gint64 now = g_get_monotonic_time ();
+        gchar *path;
+        int32_t result;
+        if (!decoder->timeshift_ring)
+            return PP_ERROR_FAILED;
+        if (!(path = cache_path (cmd->arg)))
+            return PP_ERROR_BADARGUMENT;
+        result = TimeshiftRing_export (decoder->timeshift_ring,
+                now - cmd->from_ms * 1000, now - cmd->to_ms * 1000, path);
+        g_free (path);
+        return result;
+    }
+    case VIDEO_DECODER_CMD_SKIP_VIDEO:
+        return command_skip_video (decoder, true);
+    case VIDEO_DECODER_CMD_DECODE_VIDEO:
+        return command_skip_video (decoder, false);
+    }
+    return PP_ERROR_BADARGUMENT;
+}
+
+/* One command per dispatch, so that the bus and the timers are served
+ * in between. Commands coalesced away leave a dispatch with nothing to do.
+ * Two toggles (pause, playPause) in a row cancel each other, but only
+ * while the player is plainly playing or paused: on a stopped or ended
+ * one the first playPause restarts it. This depends on the worker state
+ * when the first of them runs, so it is decided here, not when queued. */
+static gboolean command_dispatch (gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    DecoderCommand *cmd, *next = NULL;
+    bool quit;
+
+    g_mutex_lock (&decoder->command_lock);
+    cmd = (DecoderCommand *) g_queue_pop_head (decoder->commands);
+    quit = decoder->quit;
+    if (cmd && !quit &&
+        (cmd->command == VIDEO_DECODER_CMD_PAUSE ||
+         cmd->command == VIDEO_DECODER_CMD_PLAY_PAUSE) &&
+        decoder->initialized && !decoder->stop && !decoder->parked &&
+        GST_STATE_TARGET (decoder->playbin) >= GST_STATE_PAUSED &&
+        (next = (DecoderCommand *) g_queue_peek_head (decoder->commands)) &&
+        next->command == cmd->command)
+        g_queue_pop_head (decoder->commands);
+    else
+        next = NULL;
+    g_mutex_unlock (&decoder->command_lock);
+
+    if (next) {
+        command_notify (decoder, cmd->command, PP_OK);
+        command_notify (decoder, next->command, PP_OK);
+        command_free (cmd);
+        command_free (next);
+    } else if (cmd) {
+        command_notify (decoder, cmd->command,
+                quit ? PP_ERROR_ABORTED : command_run (decoder, cmd));
+        command_free (cmd);
+    }
+    return FALSE;
+}
+
+static gboolean command_quit (gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    g_main_loop_quit (decoder->loop);
+    return FALSE;
+}
+
+static gpointer command_thread (gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    DecoderCommand *cmd;
+
+    g_main_context_push_thread_default (decoder->context);
+    g_main_loop_run (decoder->loop);
+
+    g_mutex_lock (&decoder->command_lock);
+    while ((cmd = (DecoderCommand *) g_queue_pop_head (decoder->commands))) {
+        g_mutex_unlock (&decoder->command_lock);
+        command_notify (decoder, cmd->command, PP_ERROR_ABORTED);
+        command_free (cmd);
+        g_mutex_lock (&decoder->command_lock);
+    }
+    g_mutex_unlock (&decoder->command_lock);
+    g_main_context_pop_thread_default (decoder->context);
+    return NULL;
+}
+
+/* Moves the hole plane to the window */
+static gboolean window_apply (gpointer user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer *)user_data;
+    int x, y;
+
+    if (!decoder->initialized || !decoder->sink || !decoder->hole)
+        return FALSE;
+    g_mutex_lock (&decoder->command_lock);
+    x = decoder->window_x;
+    y = decoder->window_y;
+    g_mutex_unlock (&decoder->command_lock);
+    g_object_set(decoder->sink, "in-plane", true,
+            "plane-x", x,
+            "plane-y", y,
+            NULL);
+    return FALSE;
+}
 
 void *VideoDecoderGstreamer_create(bool hole)
 {
@@ -134,6 +1469,17 @@ void *VideoDecoderGstreamer_create(bool hole)
     g_print("---VideoDecoderGstreamer::create\n");
     memset (decoder, 0, sizeof(VideoDecoderGstreamer));
     decoder->hole = hole;
+    decoder->frame_width = 320;
+    decoder->frame_height = 240;
+    decoder->video_enabled = 1;
+    decoder->overlay_expiry = GST_CLOCK_TIME_NONE;
+    decoder->overlay_paused_at = GST_CLOCK_TIME_NONE;
+    g_mutex_init (&decoder->overlay_lock);
+    g_mutex_init (&decoder->timeshift_lock);
+    g_mutex_init (&decoder->command_lock);
+    decoder->commands = g_queue_new ();
+    decoder->context = g_main_context_new ();
+    decoder->loop = g_main_loop_new (decoder->context, FALSE);
 
     if (!decoder->hole) {
          decoder->queue =
@@ -142,25 +1488,101 @@ void *VideoDecoderGstreamer_create(bool hole)
     return (void*)decoder;
 }
 
-void VideoDecoderGstreamer_release(void *gst) {
-    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
-    if (!decoder->initialized)
-        return;
-
+/* Also unwinds a failed initialize, which leaves initialized false */
+static void decoder_teardown (VideoDecoderGstreamer *decoder)
+{
     decoder->stop = true;
+    decoder->playing = false;
+    decoder->parked = false;
+    decoder->hidden_flags = 0;
+    decoder_detach (&decoder->bus_watch);
+    decoder_detach (&decoder->memory_timer);
     if(NULL != decoder->bus) {
       gst_object_unref (decoder->bus);
       decoder->bus = NULL;
     }
+    decoder_detach (&decoder->abr_timer);
+    decoder_detach (&decoder->audio_timer);
+    if (decoder->abr_demux) {
+      gst_object_unref (decoder->abr_demux);
+      decoder->abr_demux = NULL;
+    }
+    decoder->qos_processed = decoder->qos_dropped = 0;
+    decoder->abr_processed = decoder->abr_dropped = 0;
+    decoder->abr_fragment_bandwidth = 0;
+    decoder->abr_variant_bitrate = 0;
+    decoder->abr_variant_width = decoder->abr_variant_height = 0;
+    decoder->abr_variant_changed = false;
 
     if(NULL != decoder->playbin) {
        gst_element_set_state (decoder->playbin, GST_STATE_NULL);
        gst_object_unref (decoder->playbin);
        decoder->playbin = NULL;
     }
+    timeshift_stop (decoder);
+    decoder->sink = NULL;
+    decoder->audio_sink = NULL;
+    g_atomic_int_set (&decoder->pipeline_bytes, 0);
+    /* what the old pipeline left in the ring is dropped by the device */
+    g_atomic_int_set (&decoder->audio_flush, 1);
+    if (decoder->capture) {
+        FrameCapture_close (decoder->capture);
+        decoder->capture = NULL;
+    }
+    gst_caps_replace (&decoder->capture_caps, NULL);
+    if (decoder->replay) {
+        FrameCapture_close (decoder->replay);
+        decoder->replay = NULL;
+    }
+    /* frames of the old pipeline are of no use anymore */
+    queue_flush (decoder);
+    overlay_clear (decoder);
     decoder->initialized = false;
 }
 
+void VideoDecoderGstreamer_release(void *gst) {
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    if (!decoder->initialized)
+        return;
+
+    decoder_teardown (decoder);
+}
+
+void VideoDecoderGstreamer_destroy(void *gst)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+
+    g_mutex_lock (&decoder->command_lock);
+    decoder->quit = true;
+    g_mutex_unlock (&decoder->command_lock);
+    if (decoder->command_thread) {
+        g_source_unref (decoder_attach (decoder, g_idle_source_new (),
+                command_quit));
+        g_thread_join (decoder->command_thread);
+    }
+
+    /* the worker is gone, nothing else touches the pipeline */
+    VideoDecoderGstreamer_release(gst);
+
+    g_queue_free (decoder->commands);
+    g_mutex_clear (&decoder->command_lock);
+    g_mutex_clear (&decoder->overlay_lock);
+    g_mutex_clear (&decoder->timeshift_lock);
+    g_free (decoder->timeshift_path);
+    g_free (decoder->capture_path);
+    if (decoder->abr)
+        AbrController_destroy (decoder->abr);
+    AudioRing_destroy (decoder->audio_ring);
+    g_main_loop_unref (decoder->loop);
+    g_main_context_unref (decoder->context);
+    g_free (decoder->url);
+    if (decoder->queue) {
+        queue_flush (decoder);
+        g_async_queue_unref (decoder->queue);
+    }
+    delete decoder;
+}
+
 int32_t VideoDecoderGstreamer_initialize(void *gst, const char *url)
 {
     VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
@@ -190,13 +1612,19 @@ int32_t VideoDecoderGstreamer_initialize(void *gst, const char *url)
     }
 
     /* Create the elements */
-    decoder->playbin = gst_element_factory_make ("playbin", "player");
+    if (g_str_has_prefix (url, REPLAY_URI_PREFIX))
+        decoder->playbin = replay_pipeline_new (decoder, url);
+    else
+        decoder->playbin = gst_element_factory_make ("playbin", "player");
 
     if (!decoder->playbin) {
         g_printerr ("Not all elements could be created.\n");
+        decoder_teardown (decoder);
         return PP_ERROR_FAILED;
     }
-    if (decoder->hole) {
+    if (decoder->replay) {
+         g_print("---VideoDecoderGstreamer::initialize replay\n");
+    } else if (decoder->hole) {
          g_print("---VideoDecoderGstreamer::initialize with hole\n");
 
          decoder->sink = gst_element_factory_make ("kmssink", "vsink");
@@ -216,7 +1644,8 @@ int32_t VideoDecoderGstreamer_initialize(void *gst, const char *url)
 
 
     } else {
-        GstElement *pipeline_sink, *color_conv;
+        GstElement *pipeline_sink, *color_conv, *text_sink = NULL;
+        guint flags = GST_PLAY_FLAG_NATIVE_VIDEO | GST_PLAY_FLAG_NATIVE_AUDIO;
 
         g_print("---VideoDecoderGstreamer::initialize without hole\n");
 
@@ -237,33 +1666,80 @@ int32_t VideoDecoderGstreamer_initialize(void *gst, const char *url)
         /* change video source caps */
         GstCaps *caps = gst_caps_new_simple("video/x-raw",
                             "format", G_TYPE_STRING, "RGB",
-                            "width", G_TYPE_INT, 320,
-                            "height", G_TYPE_INT, 240,
+                            "width", G_TYPE_INT, decoder->frame_width,
+                            "height", G_TYPE_INT, decoder->frame_height,
                             NULL) ;
 
         gst_bin_add_many (GST_BIN (pipeline_sink), color_conv, decoder->sink, NULL);
         gst_element_link_filtered(color_conv, decoder->sink, caps) ;
 
+        if (decoder->subtitles != VIDEO_DECODER_SUBTITLES_OFF)
+            flags |= GST_PLAY_FLAG_TEXT;
+        if (decoder->subtitles == VIDEO_DECODER_SUBTITLES_GPU &&
+            (text_sink = overlay_sink_new (decoder)))
+            g_object_set (decoder->playbin, "text-sink", text_sink, NULL);
+
         /* Set the URI to play */
         g_object_set (decoder->playbin, "uri", url,
               "video-sink", pipeline_sink,
-              "flags", GST_PLAY_FLAG_NATIVE_VIDEO |
-               GST_PLAY_FLAG_NATIVE_AUDIO,
+              "flags", flags,
                NULL);
         gst_caps_unref(caps) ;
 
+        if (decoder->capture_path) {
+            decoder->capture = FrameCapture_openWriter (decoder->capture_path,
+                    decoder->capture_payload);
+            if (!decoder->capture)
+                g_printerr ("Unable to create the capture %s.\n", decoder->capture_path);
+        }
+    }
+
+    /* the replay pipeline is not a playbin and has no network source */
+    if (!decoder->replay && decoder->timeshift_path &&
+        !timeshift_start (decoder, url)) {
+        decoder_teardown (decoder);
+        return PP_ERROR_FAILED;
+    }
+
+    if (!decoder->replay && decoder->budget_bytes)
+        g_object_set (decoder->playbin, "buffer-size", (gint)(decoder->budget_bytes / 2), NULL);
+
+    if (!decoder->replay && decoder->audio_ring) {
+        GstElement *audio_sink = audio_sink_new (decoder);
+        if (audio_sink)
+            g_object_set (decoder->playbin, "audio-sink", audio_sink, NULL);
     }
 
     /* Add a bus watch, so we get notified when a message arrives */
     decoder->bus = gst_pipeline_get_bus(GST_PIPELINE(decoder->playbin));
-    gst_bus_add_watch(decoder->bus, gstPlayer_handle_message, gst);
+    decoder->bus_watch = decoder_attach (decoder, gst_bus_create_watch (decoder->bus),
+            (GSourceFunc) gstPlayer_handle_message);
+    decoder->memory_timer = decoder_attach (decoder,
+            g_timeout_source_new (MEMORY_INTERVAL_MS), memory_tick);
+    if (decoder->abr && !decoder->replay) {
+        /* start from the caps the previous stream ended with */
+        abr_apply (decoder);
+        decoder->abr_timer = decoder_attach (decoder,
+                g_timeout_source_new (ABR_INTERVAL_MS), abr_tick);
+    }
+    if (decoder->audio_sink)
+        decoder->audio_timer = decoder_attach (decoder,
+                g_timeout_source_new (AUDIO_INTERVAL_MS), audio_tick);
 
     GstStateChangeReturn ret = gst_element_set_state (decoder->playbin, GST_STATE_READY);
     if (ret == GST_STATE_CHANGE_FAILURE) {
         g_printerr ("Unable to set the pipeline to the ready state.\n");
+        decoder_teardown (decoder);
         return PP_ERROR_FAILED;
     }
     decoder->initialized = true;
+    decoder->stop = false;
+
+    g_mutex_lock (&decoder->command_lock);
+    bool window = decoder->window_w && decoder->window_h;
+    g_mutex_unlock (&decoder->command_lock);
+    if (window)
+        window_apply (decoder);
 
     return PP_OK;
 }
@@ -330,21 +1806,24 @@ bool VideoDecoderGstreamer_isPlaying(void *gst) {
 
 void * VideoDecoderGstreamer_getBuffer(void *gst, int *size) {
     VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
-    if (!decoder->initialized)
-        return NULL;
 
+    /* release empties the queue, the pipeline itself is not looked at */
     if (!decoder->hole) {
         GstMiniObject *object = NULL;
         void *data;
         if (g_async_queue_length (decoder->queue) == 0) {
             return NULL;
         }
-        else if ((object = (GstMiniObject *)g_async_queue_try_pop (decoder->queue))) {
+        g_async_queue_lock (decoder->queue);
+        object = queue_pop_unlocked (decoder);
+        g_async_queue_unlock (decoder->queue);
+        if (object) {
             if (GST_IS_BUFFER (object)) {
                 g_print("---gstPlayer_getBuffer %d\n", __LINE__);
                 GstBuffer *buffer = GST_BUFFER_CAST (object);
                 GstMapInfo mapinfo = { 0, };
-                guint8 *gstdata, gstsize;
+                guint8 *gstdata;
+                gsize gstsize;
                 g_print("---g_async_queue_try_pop\n");
 
                 gst_buffer_map (buffer, &mapinfo, GST_MAP_READ);
@@ -384,23 +1863,395 @@ void * VideoDecoderGstreamer_getBuffer(void *gst, int *size) {
 }
 void VideoDecoderGstreamer_setWindow(void *gst, int x, int y, int w, int h) {
     VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
-    char rect[64];
 
-    if (!decoder->initialized)
+    g_mutex_lock (&decoder->command_lock);
+    decoder->window_x = x;
+    decoder->window_y = y;
+    decoder->window_w = w;
+    decoder->window_h = h;
+    g_mutex_unlock (&decoder->command_lock);
+
+    /* applied by the worker, initialize applies it otherwise */
+    g_source_unref (decoder_attach (decoder, g_idle_source_new (), window_apply));
+}
+void VideoDecoderGstreamer_setFrameSize(void *gst, int width, int height)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    decoder->frame_width = width;
+    decoder->frame_height = height;
+}
+
+void VideoDecoderGstreamer_setDropPolicy(void *gst,
+        VideoDecoderDropPolicy policy, int max_queued)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    decoder->drop_policy = policy;
+    decoder->max_queued = max_queued > 0 ? max_queued : 1;
+}
+
+void VideoDecoderGstreamer_getStats(void *gst, unsigned *frames,
+        unsigned *dropped)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    if (frames)
+        *frames = g_atomic_int_get (&decoder->frames);
+    if (dropped)
+        *dropped = g_atomic_int_get (&decoder->dropped);
+}
+
+void VideoDecoderGstreamer_setSubtitles(void *gst, VideoDecoderSubtitles mode)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    decoder->subtitles = mode;
+}
+
+void *VideoDecoderGstreamer_getOverlay(void *gst, bool *visible)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    GstMapInfo mapinfo = { 0, };
+    gsize size = (gsize) decoder->frame_width * decoder->frame_height * 4;
+    void *data = NULL;
+
+    g_mutex_lock (&decoder->overlay_lock);
+    if (decoder->overlay) {
+        if (gst_buffer_map (decoder->overlay, &mapinfo, GST_MAP_READ)) {
+            if (mapinfo.size >= size) {
+                data = malloc (size);
+                memcpy (data, mapinfo.data, size);
+            }
+            gst_buffer_unmap (decoder->overlay, &mapinfo);
+        }
+        gst_buffer_replace (&decoder->overlay, NULL);
+    }
+    if (decoder->overlay_shown && GST_CLOCK_TIME_IS_VALID (decoder->overlay_expiry)) {
+        GstClockTime running = overlay_running_time_unlocked (decoder);
+        *visible = !GST_CLOCK_TIME_IS_VALID (running) ||
+                running < decoder->overlay_expiry;
+    } else {
+        *visible = decoder->overlay_shown;
+    }
+    g_mutex_unlock (&decoder->overlay_lock);
+    return data;
+}
+
+void VideoDecoderGstreamer_setVideoEnabled(void *gst, bool enabled)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+
+    g_atomic_int_set (&decoder->video_enabled, enabled);
+    if (!enabled)
+        queue_flush (decoder);
+}
+
+void VideoDecoderGstreamer_setCapture(void *gst, const char *path,
+        bool payload)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    g_free (decoder->capture_path);
+    decoder->capture_path = cache_path (path);
+    if (path && !decoder->capture_path)
+        g_printerr ("Capture needs a file name, not %s.\n", path);
+    decoder->capture_payload = payload;
+}
+
+void VideoDecoderGstreamer_setAbr(void *gst, VideoDecoderAbrSwitch callback,
+        void *user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    if (!decoder->abr)
+        decoder->abr = AbrController_create ();
+    decoder->abr_switch = callback;
+    decoder->abr_user_data = user_data;
+}
+
+void VideoDecoderGstreamer_setAbrCeiling(void *gst, int width, int height,
+        uint64_t max_bitrate)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    if (decoder->abr)
+        AbrController_setCeiling (decoder->abr, width, height, max_bitrate);
+}
+
+bool VideoDecoderGstreamer_setAudioOutput(void *gst, int rate, int channels,
+        int ring_ms)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    guint64 size = (guint64) rate * channels * 2 * ring_ms / 1000;
+
+    /* the device may already be reading the ring */
+    if (decoder->audio_ring || rate <= 0 || channels <= 0 || ring_ms <= 0 ||
+        size > G_MAXUINT32)
+        return false;
+    decoder->audio_ring = AudioRing_create ((guint32) size);
+    if (!decoder->audio_ring)
+        return false;
+    decoder->audio_rate = rate;
+    decoder->audio_channels = channels;
+    decoder->audio_starved = true;
+    /* until the device has reported its latency */
+    decoder->audio_latency_us = ring_ms * 1000 / 2;
+    return true;
+}
+
+/* Compares when the next byte of the ring is due with when the device
+ * will play it, drops what is late or plays silence until it is due,
+ * then hands the ring over, padded with silence when it runs dry. */
+void VideoDecoderGstreamer_readAudio(void *gst, void *data, uint32_t size,
+        int64_t latency_us)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    uint8_t *out = (uint8_t *) data;
+    gint64 bytes_per_sec;
+    guint frame;
+    guint32 read;
+    gint seq;
+
+    if (!decoder->audio_ring) {
+        memset (out, 0, size);
         return;
+    }
+    bytes_per_sec = decoder->audio_rate * decoder->audio_channels * 2;
+    frame = decoder->audio_channels * 2;
+    if (g_atomic_int_compare_and_exchange (&decoder->audio_flush, 1, 0))
+        AudioRing_discard (decoder->audio_ring);
+    g_atomic_int_set (&decoder->audio_device_us, (gint) latency_us);
+    g_atomic_int_set (&decoder->audio_period_us,
+            (gint) ((gint64) size * G_USEC_PER_SEC / bytes_per_sec));
+
+    seq = g_atomic_int_get (&decoder->audio_due_seq);
+    if (seq && !(seq & 1) && AudioRing_fill (decoder->audio_ring)) {
+        gint64 due_us = decoder->audio_due_us;
+        guint32 position = decoder->audio_due_position;
+
+        /* not updated meanwhile by audio_cb */
+        if (g_atomic_int_get (&decoder->audio_due_seq) == seq) {
+            gint32 since = (gint32) (AudioRing_readPosition (decoder->audio_ring) -
+                    position);
+            gint64 late_us = g_get_monotonic_time () + latency_us -
+                    (due_us + (gint64) since * G_USEC_PER_SEC / bytes_per_sec);
+
+            g_atomic_int_set (&decoder->audio_offset_us, (gint) late_us);
+            if (late_us > AUDIO_RESYNC_US) {
+                guint32 skip = late_us * bytes_per_sec / G_USEC_PER_SEC;
+                AudioRing_read (decoder->audio_ring, NULL, skip - skip % frame);
+                g_atomic_int_inc (&decoder->audio_resyncs);
+            } else if (late_us < -AUDIO_RESYNC_US) {
+                guint32 silence = MIN (size,
+                        -late_us * bytes_per_sec / G_USEC_PER_SEC);
+                silence -= silence % frame;
+                memset (out, 0, silence);
+                out += silence;
+                size -= silence;
+                g_atomic_int_inc (&decoder->audio_resyncs);
+            }
+        }
+    }
+
+    read = AudioRing_read (decoder->audio_ring, out, size);
+    if (read < size) {
+        memset (out + read, 0, size - read);
+        /* a pause or the end of the stream also drain the ring */
+        if (!decoder->audio_starved && decoder->playing && !decoder->parked)
+            g_atomic_int_inc (&decoder->audio_underruns);
+        decoder->audio_starved = true;
+    } else {
+        decoder->audio_starved = false;
+    }
+}
+
+void VideoDecoderGstreamer_setParkToReady(void *gst, bool ready)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    decoder->park_to_ready = ready;
+}
+
+void VideoDecoderGstreamer_setMemoryBudget(void *gst, unsigned bytes)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    decoder->budget_bytes = bytes;
+}
+
+void VideoDecoderGstreamer_setTextureBytes(void *gst, unsigned bytes)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    g_atomic_int_set (&decoder->texture_bytes, bytes);
+}
 
-    sprintf(rect, "%d,%d,%d,%d", x, y, w, h);
-    if (decoder->sink && decoder->hole)
-        //g_object_set(decoder->sink, "rectangle", rect, NULL);
-        g_object_set(decoder->sink, "in-plane", true,
-                "plane-x", x,
-                "plane-y", y,
-                NULL);
+void VideoDecoderGstreamer_getMemoryStats(void *gst,
+        VideoDecoderMemoryStats *stats)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
 
+    memset (stats, 0, sizeof (*stats));
+    if (decoder->queue) {
+        g_async_queue_lock (decoder->queue);
+        stats->queued_bytes = decoder->queued_bytes;
+        stats->queued_frames = g_async_queue_length_unlocked (decoder->queue);
+        g_async_queue_unlock (decoder->queue);
+    }
+    stats->texture_bytes = g_atomic_int_get (&decoder->texture_bytes);
+    stats->pipeline_bytes = g_atomic_int_get (&decoder->pipeline_bytes);
+    stats->budget_bytes = decoder->budget_bytes;
+    stats->budget_drops = g_atomic_int_get (&decoder->budget_drops);
 }
+
 bool VideoDecoderGstreamer_useHole(void *gst)
 {
     VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
     return decoder->hole;
 }
 
+void VideoDecoderGstreamer_setCommandCallback(void *gst,
+        VideoDecoderCommandDone callback, void *user_data)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    decoder->command_done = callback;
+    decoder->command_user_data = user_data;
+}
+
+/* Only the state the player ends up in matters, so redundant commands
+ * still waiting in the queue are merged and reported as completed:
+ *  - two pending toggles (pause, playPause) may cancel each other, see
+ *    command_dispatch
+ *  - a play after a pending play is dropped
+ *  - a new url (or timeshift position) replaces a pending one
+ *  - a park and an unpark still pending cancel each other, so do a
+ *    skipVideo and a decodeVideo
+ *  - a release makes everything queued before it moot, the url of a
+ *    pending initialize is remembered for a later playPause though */
+static int32_t command_queue (VideoDecoderGstreamer *decoder, DecoderCommand *cmd)
+{
+    VideoDecoderCommand command = cmd->command;
+    GQueue coalesced = G_QUEUE_INIT;
+    DecoderCommand *tail;
+
+    g_mutex_lock (&decoder->command_lock);
+    if (!decoder->command_thread)
+        decoder->command_thread = g_thread_new ("gst-commands", command_thread, decoder);
+
+    tail = (DecoderCommand *) g_queue_peek_tail (decoder->commands);
+    switch (command) {
+    case VIDEO_DECODER_CMD_PAUSE:
+    case VIDEO_DECODER_CMD_PLAY_PAUSE:
+        break;
+    case VIDEO_DECODER_CMD_PLAY:
+        if (tail && tail->command == VIDEO_DECODER_CMD_PLAY) {
+            g_queue_push_tail (&coalesced, cmd);
+            cmd = NULL;
+        }
+        break;
+    case VIDEO_DECODER_CMD_PARK:
+    case VIDEO_DECODER_CMD_UNPARK:
+        if (tail && tail->command != command &&
+            (tail->command == VIDEO_DECODER_CMD_PARK ||
+             tail->command == VIDEO_DECODER_CMD_UNPARK)) {
+            g_queue_push_tail (&coalesced, g_queue_pop_tail (decoder->commands));
+            g_queue_push_tail (&coalesced, cmd);
+            cmd = NULL;
+        }
+        break;
+    case VIDEO_DECODER_CMD_SKIP_VIDEO:
+    case VIDEO_DECODER_CMD_DECODE_VIDEO:
+        if (tail && tail->command != command &&
+            (tail->command == VIDEO_DECODER_CMD_SKIP_VIDEO ||
+             tail->command == VIDEO_DECODER_CMD_DECODE_VIDEO)) {
+            g_queue_push_tail (&coalesced, g_queue_pop_tail (decoder->commands));
+            g_queue_push_tail (&coalesced, cmd);
+            cmd = NULL;
+        }
+        break;
+    case VIDEO_DECODER_CMD_INITIALIZE:
+        g_free (decoder->url);
+        decoder->url = g_strdup (cmd->arg);
+        /* fall through */
+    case VIDEO_DECODER_CMD_TIMESHIFT:
+        if (tail && tail->command == command)
+            g_queue_push_tail (&coalesced, g_queue_pop_tail (decoder->commands));
+        break;
+    case VIDEO_DECODER_CMD_TIMESHIFT_EXPORT:
+        break;
+    case VIDEO_DECODER_CMD_RELEASE:
+        while ((tail = (DecoderCommand *) g_queue_pop_head (decoder->commands)))
+            g_queue_push_tail (&coalesced, tail);
+        break;
+    }
+    if (cmd) {
+        g_queue_push_tail (decoder->commands, cmd);
+        g_source_unref (decoder_attach (decoder, g_idle_source_new (),
+                command_dispatch));
+    }
+    g_mutex_unlock (&decoder->command_lock);
+
+    while ((tail = (DecoderCommand *) g_queue_pop_head (&coalesced))) {
+        command_notify (decoder, tail->command, PP_OK);
+        command_free (tail);
+    }
+    return PP_OK_COMPLETIONPENDING;
+}
+
+int32_t VideoDecoderGstreamer_queueCommand(void *gst,
+        VideoDecoderCommand command, const char *url)
+{
+    DecoderCommand *cmd = g_new0 (DecoderCommand, 1);
+
+    cmd->command = command;
+    cmd->arg = g_strdup (url);
+    return command_queue ((VideoDecoderGstreamer*)gst, cmd);
+}
+
+int32_t VideoDecoderGstreamer_queueTimeshift(void *gst,
+        VideoDecoderCommand command, int64_t from_ms, int64_t to_ms,
+        const char *path)
+{
+    DecoderCommand *cmd;
+
+    if (command != VIDEO_DECODER_CMD_TIMESHIFT &&
+        command != VIDEO_DECODER_CMD_TIMESHIFT_EXPORT)
+        return PP_ERROR_BADARGUMENT;
+    cmd = g_new0 (DecoderCommand, 1);
+    cmd->command = command;
+    cmd->arg = g_strdup (path);
+    cmd->from_ms = from_ms;
+    cmd->to_ms = to_ms;
+    return command_queue ((VideoDecoderGstreamer*)gst, cmd);
+}
+
+void VideoDecoderGstreamer_setTimeshift(void *gst, const char *path,
+        uint64_t size)
+{
+    VideoDecoderGstreamer *decoder = (VideoDecoderGstreamer*)gst;
+    g_free (decoder->timeshift_path);
+    decoder->timeshift_path = cache_path (path);
+    if (path && !decoder->timeshift_path)
+        g_printerr ("Timeshift needs a file name, not %s.\n", path);
+    decoder->timeshift_size = size;
+}
+
+const char *VideoDecoderGstreamer_commandName(VideoDecoderCommand command)
+{
+    switch (command) {
+    case VIDEO_DECODER_CMD_INITIALIZE:
+        return "initialize";
+    case VIDEO_DECODER_CMD_PLAY:
+        return "play";
+    case VIDEO_DECODER_CMD_PAUSE:
+        return "pause";
+    case VIDEO_DECODER_CMD_PLAY_PAUSE:
+        return "playPause";
+    case VIDEO_DECODER_CMD_RELEASE:
+        return "release";
+    case VIDEO_DECODER_CMD_PARK:
+        return "park";
+    case VIDEO_DECODER_CMD_UNPARK:
+        return "unpark";
+    case VIDEO_DECODER_CMD_TIMESHIFT:
+        return "timeshift";
+    case VIDEO_DECODER_CMD_TIMESHIFT_EXPORT:
+        return "timeshiftExport";
+    case VIDEO_DECODER_CMD_SKIP_VIDEO:
+        return "skipVideo";
+    case VIDEO_DECODER_CMD_DECODE_VIDEO:
+        return "decodeVideo";
+    }
+    return "unknown";
+}
@@ -8,9 +8,75 @@
 #ifndef PPAPI_GSTREAMER_VIDEO_DECODER_H_
 #define PPAPI_GSTREAMER_VIDEO_DECODER_H_
 
+/* What to do with decoded frames the renderer has not picked up yet */
+typedef enum {
+  VIDEO_DECODER_DROP_NONE = 0,     /* queue every frame */
+  VIDEO_DECODER_DROP_OLDEST,       /* keep at most max_queued frames */
+  VIDEO_DECODER_DROP_TO_LATEST     /* keep only the newest frame */
+} VideoDecoderDropPolicy;
+
+/* Where subtitles are blended into the video */
+typedef enum {
+  VIDEO_DECODER_SUBTITLES_OFF = 0,
+  VIDEO_DECODER_SUBTITLES_PIPELINE, /* by playbin, on the CPU, every frame */
+  VIDEO_DECODER_SUBTITLES_GPU       /* rendered apart, see getOverlay */
+} VideoDecoderSubtitles;
+
+/* Memory held on behalf of one decoder, in bytes */
+typedef struct {
+  unsigned queued_bytes;    /* decoded frames waiting for the renderer */
+  unsigned queued_frames;
+  unsigned texture_bytes;   /* as reported by the renderer */
+  unsigned pipeline_bytes;  /* held by the pipeline queues, sampled every second */
+  unsigned budget_bytes;    /* 0 when unlimited */
+  unsigned budget_drops;    /* frames dropped to stay within the budget */
+} VideoDecoderMemoryStats;
+
+/* Commands served by the per-decoder worker thread, so that the state
+ * changes never block the caller */
+typedef enum {
+  VIDEO_DECODER_CMD_INITIALIZE = 0, /* takes the url */
+  VIDEO_DECODER_CMD_PLAY,
+  VIDEO_DECODER_CMD_PAUSE,          /* toggles like VideoDecoderGstreamer_pause */
+  VIDEO_DECODER_CMD_PLAY_PAUSE,     /* (re)starts a stopped player, else toggles */
+  VIDEO_DECODER_CMD_RELEASE,
+  VIDEO_DECODER_CMD_PARK,           /* PAUSED or READY, keeping the position */
+  VIDEO_DECODER_CMD_UNPARK,         /* back to the state before parking */
+  VIDEO_DECODER_CMD_TIMESHIFT,      /* see queueTimeshift */
+  VIDEO_DECODER_CMD_TIMESHIFT_EXPORT,
+  VIDEO_DECODER_CMD_SKIP_VIDEO,     /* removes video from playbin, audio goes on */
+  VIDEO_DECODER_CMD_DECODE_VIDEO    /* puts it back */
+} VideoDecoderCommand;
+
+/* Called from the worker thread, or from the caller of queueCommand when
+ * the command was coalesced with another one. */
+typedef void (*VideoDecoderCommandDone)(void *user_data,
+        VideoDecoderCommand command, int32_t result);
+
+/* Adaptive streaming caps applied to the demuxer, 0 meaning unlimited,
+ * and the variant the demuxer is playing within them, 0 when unknown */
+typedef struct {
+  uint64_t max_bitrate;     /* bits/s */
+  int max_width;
+  int max_height;
+  uint64_t bandwidth;       /* estimate, bits/s */
+  int buffer_percent;       /* -1 when unknown */
+  const char *reason;       /* see AbrDecision, "variant" when only the
+                               variant changed */
+  uint64_t variant_bitrate; /* as announced by the demuxer, bits/s */
+  int variant_width;        /* of the decoded video */
+  int variant_height;
+} VideoDecoderAbrEvent;
+
+/* Called from the decoder worker thread */
+typedef void (*VideoDecoderAbrSwitch)(void *user_data,
+        const VideoDecoderAbrEvent *event);
 
 void *VideoDecoderGstreamer_create(bool hole);
+/* release, initialize, play, stop and pause touch the pipeline, they are
+ * meant for the worker: use queueCommand once it is running. */
 void VideoDecoderGstreamer_release(void *gst);
+void VideoDecoderGstreamer_destroy(void *gst);
 
 int32_t VideoDecoderGstreamer_initialize(void *gst, const char *url);
 int32_t VideoDecoderGstreamer_play(void *gst);
@@ -18,8 +84,89 @@ int32_t VideoDecoderGstreamer_stop(void *gst);
 int32_t VideoDecoderGstreamer_pause(void *gst);
 bool VideoDecoderGstreamer_isPlaying(void *gst);
 
+void VideoDecoderGstreamer_setCommandCallback(void *gst,
+        VideoDecoderCommandDone callback, void *user_data);
+/* Returns PP_OK_COMPLETIONPENDING, completion goes to the command callback */
+int32_t VideoDecoderGstreamer_queueCommand(void *gst,
+        VideoDecoderCommand command, const char *url);
+/* TIMESHIFT: replays from from_ms behind live, 0 goes back to live.
+ * TIMESHIFT_EXPORT: writes the window [from_ms, to_ms] behind live to the
+ * file path names in the plugin cache directory, path being a bare file
+ * name (PP_ERROR_BADARGUMENT otherwise). */
+int32_t VideoDecoderGstreamer_queueTimeshift(void *gst,
+        VideoDecoderCommand command, int64_t from_ms, int64_t to_ms,
+        const char *path);
+const char *VideoDecoderGstreamer_commandName(VideoDecoderCommand command);
+
+/* Must be called before initialize: the source is recorded into a ring of
+ * size bytes mapped from the file path names in the plugin cache directory
+ * ($XDG_CACHE_HOME/ppapi-gstreamer), and playbin plays from that ring, so
+ * live sources (MPEG-TS) can be paused and replayed without the network.
+ * Anything but a bare file name leaves timeshift disabled. */
+void VideoDecoderGstreamer_setTimeshift(void *gst, const char *path,
+        uint64_t size);
+
+/* Must be called before initialize (texture mode): the caps, timestamps
+ * and, with payload, the bytes of every decoded frame are written to the
+ * file path names in the plugin cache directory, anything but a bare file
+ * name disabling the capture. Such a capture is played back by
+ * initializing with "replay://<name>", at the cadence the frames were
+ * captured, or as fast as they can be read with "replay://<name>?speed=max". */
+void VideoDecoderGstreamer_setCapture(void *gst, const char *path,
+        bool payload);
+
+/* Must be called before initialize: HLS/DASH variants are then capped
+ * every second from the measured bandwidth, buffer level and late frames,
+ * callback is called whenever the caps change. */
+void VideoDecoderGstreamer_setAbr(void *gst, VideoDecoderAbrSwitch callback,
+        void *user_data);
+/* Largest variant worth decoding, usually the displayed video size */
+void VideoDecoderGstreamer_setAbrCeiling(void *gst, int width, int height,
+        uint64_t max_bitrate);
+
+/* Must be called once, before initialize: audio is converted to
+ * interleaved S16LE of the given rate and channels and queued in a ring
+ * of ring_ms for readAudio, instead of going to the native audio sink.
+ * Returns false when no ring could be created, audio then stays native. */
+bool VideoDecoderGstreamer_setAudioOutput(void *gst, int rate, int channels,
+        int ring_ms);
+/* Called from the audio device thread, never blocks: fills size bytes,
+ * latency_us being the time until the first of them is heard. The device
+ * must be stopped before destroy. */
+void VideoDecoderGstreamer_readAudio(void *gst, void *data, uint32_t size,
+        int64_t latency_us);
+
 void * VideoDecoderGstreamer_getBuffer(void *gst, int *size);
 
+/* Texture mode only, must be called before initialize. Frames are
+ * converted to RGB of the given size (default 320x240). */
+void VideoDecoderGstreamer_setFrameSize(void *gst, int width, int height);
+void VideoDecoderGstreamer_setDropPolicy(void *gst,
+        VideoDecoderDropPolicy policy, int max_queued);
+void VideoDecoderGstreamer_getStats(void *gst, unsigned *frames,
+        unsigned *dropped);
+
+/* Texture mode only, must be called before initialize */
+void VideoDecoderGstreamer_setSubtitles(void *gst, VideoDecoderSubtitles mode);
+/* VIDEO_DECODER_SUBTITLES_GPU: returns the overlay (RGBA, frame size, to
+ * be freed) when it changed since the last call, NULL otherwise. visible
+ * tells whether the last returned overlay is still to be shown. */
+void *VideoDecoderGstreamer_getOverlay(void *gst, bool *visible);
+
+/* Hidden player: decoded frames are no longer handed to the renderer.
+ * Queue VIDEO_DECODER_CMD_SKIP_VIDEO to stop decoding them as well. */
+void VideoDecoderGstreamer_setVideoEnabled(void *gst, bool enabled);
+/* true parks in READY, releasing decoders and buffers, instead of PAUSED */
+void VideoDecoderGstreamer_setParkToReady(void *gst, bool ready);
+
+/* Half of the budget goes to playbin network buffering (applied on the
+ * next initialize), the rest to queued frames and textures. Frames are
+ * dropped, oldest first, to stay within it. */
+void VideoDecoderGstreamer_setMemoryBudget(void *gst, unsigned bytes);
+void VideoDecoderGstreamer_setTextureBytes(void *gst, unsigned bytes);
+void VideoDecoderGstreamer_getMemoryStats(void *gst,
+        VideoDecoderMemoryStats *stats);
+
 
 void VideoDecoderGstreamer_setWindow(void *gst, int x, int y, int w, int h);
 